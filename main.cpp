@@ -4,15 +4,29 @@
 
 #include <fstream>
 #include <sstream>
+#include <iomanip>
 
 #include <map>
+#include <unordered_map>
 #include <string>
 #include <array>
+#include <string_view>
+#include <span>
 #include <thread>
 #include <cctype> 
 #include <chrono>
 #include <algorithm>
+#include <cmath>
+#include <vector>
+#include <memory>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
 #include <errno.h>
+#include <time.h>
+#include <getopt.h>
 
 #include <gio/gio.h>
 #include <glib.h>
@@ -25,6 +39,10 @@
 #include <sys/socket.h>
 #include <sys/wait.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
 #define BT_DEV_NAME "Elink Bluetooth Keyboard"
 #define HID_PROFILE_UUID "00001124-0000-1000-8000-00805f9b34fb"
@@ -43,6 +61,8 @@ struct BluetoothConnection {
     int interrupt_socket;
     int control_client;
     int interrupt_client;
+    bdaddr_t remote_addr;   /* Host that opened the control channel */
+    int interrupt_sndbuf = 0;   /* SO_SNDBUF of the L2CAP interrupt socket, 0 when not Bluetooth */
 };
 
 void cleanup_connection(BluetoothConnection &conn){
@@ -154,7 +174,7 @@ BluetoothConnection listen_for_connections(){
 
     std::cout << "Bluetooth HID L2CAP Server starting..." << std::endl;
 
-    BluetoothConnection conn = {0, 0, 0, 0};
+    BluetoothConnection conn = {0, 0, 0, 0, {}};
 
     std::cout << "1. Creating L2CAP server sockets..." << std::endl;
 
@@ -224,6 +244,18 @@ BluetoothConnection listen_for_connections(){
         return conn;
     }
 
+    /* Reports are written through send_interrupt_report(), which never blocks on a stalled host */
+    fcntl(conn.interrupt_client, F_SETFL, fcntl(conn.interrupt_client, F_GETFL) | O_NONBLOCK);
+
+    /* Read once, interrupt_queued_bytes() needs it for every report */
+    socklen_t sndbuf_len = sizeof(conn.interrupt_sndbuf);
+    if (getsockopt(conn.interrupt_client, SOL_SOCKET, SO_SNDBUF, &conn.interrupt_sndbuf, &sndbuf_len) < 0) {
+        perror("Failed to read the interrupt send buffer size");
+        conn.interrupt_sndbuf = 0;
+    }
+
+    bacpy(&conn.remote_addr, &rem_addr_ctrl.l2_bdaddr);
+
     char ctrl_bdaddr[18] = { 0 };
     ba2str(&rem_addr_ctrl.l2_bdaddr, ctrl_bdaddr);
 
@@ -236,316 +268,4596 @@ BluetoothConnection listen_for_connections(){
 
     std::cout << "6. L2CAP HID channels are ready!" << std::endl;
 
-    return conn;
-}
+    return conn;
+}
+
+/* Modifier byte of the keyboard input report (bit 0 = Left Control ... bit 7 = Right GUI) */
+#define MOD_LEFTCTRL    0x01
+#define MOD_LEFTSHIFT   0x02
+#define MOD_LEFTALT     0x04
+#define MOD_LEFTMETA    0x08
+#define MOD_RIGHTCTRL   0x10
+#define MOD_RIGHTSHIFT  0x20
+#define MOD_RIGHTALT    0x40
+#define MOD_RIGHTMETA   0x80
+
+struct KeyStroke {
+    uint8_t usage;      /* Keyboard page usage, 0 = character can't be typed */
+    uint8_t modifier;   /* Modifier byte held while usage is pressed */
+};
+
+/*
+ * US layout ASCII -> HID usage table, generated at compile time.
+ * Typing a character is a single array index.
+ */
+constexpr std::array<KeyStroke, 128> make_ascii_keymap() {
+    std::array<KeyStroke, 128> map{};
+
+    for (int i = 0; i < 26; i++) {
+        map['a' + i] = { static_cast<uint8_t>(0x04 + i), 0 };
+        map['A' + i] = { static_cast<uint8_t>(0x04 + i), MOD_LEFTSHIFT };
+    }
+
+    /* 1..9 then 0, the shifted symbols share the same keys */
+    const char digits[] = "1234567890";
+    const char shifted_digits[] = "!@#$%^&*()";
+    for (int i = 0; i < 10; i++) {
+        map[static_cast<uint8_t>(digits[i])] = { static_cast<uint8_t>(0x1E + i), 0 };
+        map[static_cast<uint8_t>(shifted_digits[i])] = { static_cast<uint8_t>(0x1E + i), MOD_LEFTSHIFT };
+    }
+
+    /* { plain, shifted, usage } */
+    const struct { char plain; char shifted; uint8_t usage; } symbols[] = {
+        { '-',  '_', 0x2D },
+        { '=',  '+', 0x2E },
+        { '[',  '{', 0x2F },
+        { ']',  '}', 0x30 },
+        { '\\', '|', 0x31 },
+        { ';',  ':', 0x33 },
+        { '\'', '"', 0x34 },
+        { '`',  '~', 0x35 },
+        { ',',  '<', 0x36 },
+        { '.',  '>', 0x37 },
+        { '/',  '?', 0x38 },
+    };
+    for (const auto &sym : symbols) {
+        map[static_cast<uint8_t>(sym.plain)] = { sym.usage, 0 };
+        map[static_cast<uint8_t>(sym.shifted)] = { sym.usage, MOD_LEFTSHIFT };
+    }
+
+    map[' '] = { 0x2C, 0 };
+    map['\t'] = { 0x2B, 0 };
+    map['\n'] = { 0x28, 0 };
+
+    return map;
+}
+
+constexpr std::array<KeyStroke, 128> ascii_keymap = make_ascii_keymap();
+
+static_assert(ascii_keymap['a'].usage == 0x04 && ascii_keymap['a'].modifier == 0, "ascii_keymap: 'a'");
+static_assert(ascii_keymap['Z'].usage == 0x1D && ascii_keymap['Z'].modifier == MOD_LEFTSHIFT, "ascii_keymap: 'Z'");
+static_assert(ascii_keymap['0'].usage == 0x27 && ascii_keymap[')'].usage == 0x27, "ascii_keymap: '0' / ')'");
+static_assert(ascii_keymap['~'].usage == 0x35 && ascii_keymap['~'].modifier == MOD_LEFTSHIFT, "ascii_keymap: '~'");
+static_assert(ascii_keymap[0x7F].usage == 0, "ascii_keymap: DEL is not typeable");
+
+/*
+ * Decode the UTF-8 sequence starting at text[pos] into cp.
+ * Returns its length in bytes, or 0 when the sequence is cut off by the
+ * end of text. Malformed bytes decode one at a time as U+FFFD.
+ */
+size_t utf8_decode(const std::string &text, size_t pos, uint32_t &cp) {
+    uint8_t lead = static_cast<uint8_t>(text[pos]);
+    size_t len;
+
+    if (lead < 0x80) {
+        cp = lead;
+        return 1;
+    } else if ((lead & 0xE0) == 0xC0) {
+        len = 2;
+        cp = lead & 0x1F;
+    } else if ((lead & 0xF0) == 0xE0) {
+        len = 3;
+        cp = lead & 0x0F;
+    } else if ((lead & 0xF8) == 0xF0) {
+        len = 4;
+        cp = lead & 0x07;
+    } else {
+        cp = 0xFFFD;
+        return 1;
+    }
+
+    for (size_t i = 1; i < len; i++) {
+        if (pos + i >= text.size()) {
+            return 0;
+        }
+        uint8_t cont = static_cast<uint8_t>(text[pos + i]);
+        if ((cont & 0xC0) != 0x80) {
+            cp = 0xFFFD;
+            return 1;
+        }
+        cp = (cp << 6) | (cont & 0x3F);
+    }
+
+    /* Overlong forms, surrogates and values past U+10FFFF */
+    static const uint32_t min_value[] = { 0, 0, 0x80, 0x800, 0x10000 };
+    if (cp < min_value[len] || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) {
+        cp = 0xFFFD;
+        return 1;
+    }
+    return len;
+}
+
+#define LAYOUT_DIR "/etc/bluetooth/layouts"
+#define LAYOUT_MAGIC "HIDL"
+#define LAYOUT_VERSION 1
+
+/*
+ * Binary keyboard layout file, little endian, built by --compile-layout:
+ *
+ *   LayoutFileHeader
+ *   uint32_t  table[table_size]       indexed by code point, 0 = not typeable,
+ *                                     else (first stroke << 8) | stroke count
+ *   KeyStroke strokes[stroke_count]   usage + modifier, dead keys and AltGr
+ *                                     characters are sequences / RIGHTALT strokes
+ */
+struct LayoutFileHeader {
+    char magic[4];
+    uint16_t version;
+    uint16_t header_size;
+    uint32_t table_size;
+    uint32_t stroke_count;
+    char name[16];
+};
+
+static_assert(sizeof(LayoutFileHeader) == 32, "LayoutFileHeader must match the file format");
+static_assert(sizeof(KeyStroke) == 2, "KeyStroke must match the file format");
+
+/*
+ * A layout file mapped read-only into memory.
+ *
+ * The file is validated once when it is opened, after that a lookup is a
+ * bounds check plus one table index, whatever the size of the layout.
+ */
+class KeyboardLayout {
+public:
+    static std::shared_ptr<const KeyboardLayout> open(const std::string &path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            std::cerr << "Cannot open layout file " << path << ": " << strerror(errno) << std::endl;
+            return nullptr;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(LayoutFileHeader)) {
+            std::cerr << "Layout file " << path << " is too short" << std::endl;
+            close(fd);
+            return nullptr;
+        }
+
+        size_t size = st.st_size;
+        void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+            std::cerr << "Cannot map layout file " << path << ": " << strerror(errno) << std::endl;
+            return nullptr;
+        }
+
+        std::shared_ptr<KeyboardLayout> layout(new KeyboardLayout(map, size));
+        if (!layout->validate(path)) {
+            return nullptr;
+        }
+        return layout;
+    }
+
+    ~KeyboardLayout() {
+        munmap(map_, map_size_);
+    }
+
+    KeyboardLayout(const KeyboardLayout &) = delete;
+    KeyboardLayout &operator=(const KeyboardLayout &) = delete;
+
+    /* Strokes that type cp, count is 0 when the layout has no way to type it */
+    const KeyStroke *lookup(uint32_t cp, size_t &count) const {
+        if (cp >= table_size_) {
+            count = 0;
+            return nullptr;
+        }
+        uint32_t entry = table_[cp];
+        count = entry & 0xFF;
+        return strokes_ + (entry >> 8);
+    }
+
+    const std::string &name() const {
+        return name_;
+    }
+
+private:
+    KeyboardLayout(void *map, size_t size) : map_(map), map_size_(size) {
+    }
+
+    bool validate(const std::string &path) {
+        const uint8_t *base = static_cast<const uint8_t *>(map_);
+        LayoutFileHeader header;
+        memcpy(&header, base, sizeof(header));
+
+        if (memcmp(header.magic, LAYOUT_MAGIC, 4) != 0 || header.version != LAYOUT_VERSION ||
+            header.header_size != sizeof(LayoutFileHeader)) {
+            std::cerr << "Layout file " << path << " has a bad header" << std::endl;
+            return false;
+        }
+
+        uint64_t expected = sizeof(LayoutFileHeader) + uint64_t(header.table_size) * sizeof(uint32_t) +
+                            uint64_t(header.stroke_count) * sizeof(KeyStroke);
+        if (expected != map_size_) {
+            std::cerr << "Layout file " << path << " size doesn't match its header" << std::endl;
+            return false;
+        }
+
+        table_size_ = header.table_size;
+        table_ = reinterpret_cast<const uint32_t *>(base + sizeof(LayoutFileHeader));
+        strokes_ = reinterpret_cast<const KeyStroke *>(table_ + table_size_);
+
+        for (uint32_t cp = 0; cp < table_size_; cp++) {
+            uint32_t first = table_[cp] >> 8;
+            uint32_t count = table_[cp] & 0xFF;
+            if (uint64_t(first) + count > header.stroke_count) {
+                std::cerr << "Layout file " << path << " entry U+" << std::hex << cp << std::dec
+                          << " points outside the stroke table" << std::endl;
+                return false;
+            }
+            for (uint32_t i = 0; i < count; i++) {
+                if (strokes_[first + i].usage == 0) {
+                    std::cerr << "Layout file " << path << " has an empty stroke" << std::endl;
+                    return false;
+                }
+            }
+        }
+
+        name_.assign(header.name, strnlen(header.name, sizeof(header.name)));
+        return true;
+    }
+
+    void *map_;
+    size_t map_size_;
+    const uint32_t *table_ = nullptr;
+    uint32_t table_size_ = 0;
+    const KeyStroke *strokes_ = nullptr;
+    std::string name_;
+};
+
+/*
+ * Layout by name ("de" -> LAYOUT_DIR/de.hidl) or path. Every file is mapped
+ * once and shared by all connections using it. "us" is the built-in
+ * ascii_keymap and returns nullptr, as does a layout that fails to load.
+ */
+std::shared_ptr<const KeyboardLayout> get_layout(const std::string &name) {
+    static std::mutex mutex;
+    static std::map<std::string, std::shared_ptr<const KeyboardLayout>> layouts;
+
+    if (name.empty() || name == "us") {
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = layouts.find(name);
+    if (it != layouts.end()) {
+        return it->second;
+    }
+
+    std::string path = name.find('/') != std::string::npos ? name : std::string(LAYOUT_DIR "/") + name + ".hidl";
+    std::shared_ptr<const KeyboardLayout> layout = KeyboardLayout::open(path);
+    if (layout) {
+        std::cout << "Loaded keyboard layout " << layout->name() << " from " << path << std::endl;
+        layouts[name] = layout;
+    }
+    return layout;
+}
+
+/* "shift+altgr+0x1f" -> { 0x1f, MOD_LEFTSHIFT | MOD_RIGHTALT } */
+bool parse_layout_stroke(const std::string &token, KeyStroke &stroke) {
+    static const std::map<std::string, uint8_t> modifier_names = {
+        { "ctrl",  MOD_LEFTCTRL },
+        { "shift", MOD_LEFTSHIFT },
+        { "alt",   MOD_LEFTALT },
+        { "meta",  MOD_LEFTMETA },
+        { "altgr", MOD_RIGHTALT },
+    };
+
+    stroke = { 0, 0 };
+    size_t start = 0;
+    size_t plus;
+    while ((plus = token.find('+', start)) != std::string::npos) {
+        auto it = modifier_names.find(token.substr(start, plus - start));
+        if (it == modifier_names.end()) {
+            return false;
+        }
+        stroke.modifier |= it->second;
+        start = plus + 1;
+    }
+
+    char *end = nullptr;
+    unsigned long usage = strtoul(token.c_str() + start, &end, 0);
+    if (*end != '\0' || usage == 0 || usage > 0xFF) {
+        return false;
+    }
+    stroke.usage = static_cast<uint8_t>(usage);
+    return true;
+}
+
+/*
+ * Build a binary layout file from its text source (layouts/<name>.txt).
+ * Each line is "U+<hex code point> <stroke> [<stroke> ...]", '#' starts a comment.
+ */
+bool compile_layout(const char *src_path, const char *dst_path) {
+    std::ifstream src(src_path);
+    if (!src.is_open()) {
+        std::cerr << "Cannot open layout source: " << src_path << std::endl;
+        return false;
+    }
+
+    std::map<uint32_t, std::vector<KeyStroke>> entries;
+    std::string line;
+    int line_no = 0;
+
+    while (std::getline(src, line)) {
+        line_no++;
+        line = line.substr(0, line.find('#'));
+
+        std::istringstream fields(line);
+        std::string cp_field;
+        if (!(fields >> cp_field)) {
+            continue;
+        }
+
+        char *end = nullptr;
+        unsigned long cp = 0;
+        if (cp_field.compare(0, 2, "U+") == 0) {
+            cp = strtoul(cp_field.c_str() + 2, &end, 16);
+        }
+        if (!end || *end != '\0' || cp > 0x10FFFF) {
+            std::cerr << src_path << ":" << line_no << ": bad code point " << cp_field << std::endl;
+            return false;
+        }
+
+        std::vector<KeyStroke> strokes;
+        std::string token;
+        while (fields >> token) {
+            KeyStroke stroke;
+            if (!parse_layout_stroke(token, stroke)) {
+                std::cerr << src_path << ":" << line_no << ": bad stroke " << token << std::endl;
+                return false;
+            }
+            strokes.push_back(stroke);
+        }
+        if (strokes.empty() || strokes.size() > 0xFF) {
+            std::cerr << src_path << ":" << line_no << ": expected 1-255 strokes" << std::endl;
+            return false;
+        }
+        entries[cp] = strokes;
+    }
+
+    if (entries.empty()) {
+        std::cerr << src_path << ": no entries" << std::endl;
+        return false;
+    }
+
+    /* Direct-indexed table up to the highest code point the layout types */
+    std::vector<uint32_t> table(entries.rbegin()->first + 1, 0);
+    std::vector<KeyStroke> strokes;
+    for (const auto &entry : entries) {
+        table[entry.first] = (static_cast<uint32_t>(strokes.size()) << 8) | entry.second.size();
+        strokes.insert(strokes.end(), entry.second.begin(), entry.second.end());
+    }
+
+    LayoutFileHeader header = {};
+    memcpy(header.magic, LAYOUT_MAGIC, 4);
+    header.version = LAYOUT_VERSION;
+    header.header_size = sizeof(LayoutFileHeader);
+    header.table_size = table.size();
+    header.stroke_count = strokes.size();
+
+    /* Layout name is the source file name without directory and extension */
+    std::string name = src_path;
+    name = name.substr(name.find_last_of('/') + 1);
+    name = name.substr(0, name.find('.'));
+    strncpy(header.name, name.c_str(), sizeof(header.name) - 1);
+
+    std::ofstream dst(dst_path, std::ios::binary | std::ios::trunc);
+    dst.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    dst.write(reinterpret_cast<const char *>(table.data()), table.size() * sizeof(uint32_t));
+    dst.write(reinterpret_cast<const char *>(strokes.data()), strokes.size() * sizeof(KeyStroke));
+    if (!dst) {
+        std::cerr << "Failed to write layout file: " << dst_path << std::endl;
+        return false;
+    }
+
+    std::cout << "Layout " << name << ": " << entries.size() << " characters, "
+              << strokes.size() << " strokes -> " << dst_path << std::endl;
+    return true;
+}
+
+/* Strokes typing cp on a host using layout (nullptr = built-in US), count is 0 when it has no key for it */
+const KeyStroke *lookup_strokes(const KeyboardLayout *layout, uint32_t cp, size_t &count) {
+    if (layout) {
+        return layout->lookup(cp, count);
+    }
+    if (cp < ascii_keymap.size() && ascii_keymap[cp].usage != 0) {
+        count = 1;
+        return &ascii_keymap[cp];
+    }
+    count = 0;
+    return nullptr;
+}
+
+enum class UnicodeMethod {
+    None,
+    Linux,      /* Ctrl+Shift+U, hex digits, Space (GTK and IBus) */
+    Windows,    /* Alt held: numpad +, hex digits (needs HKCU\Control Panel\Input Method EnableHexNumpad = "1") */
+    MacOS,      /* Option held: 4 hex digits per UTF-16 unit ("Unicode Hex Input" source selected) */
+};
+
+bool parse_unicode_method(const std::string &name, UnicodeMethod &method) {
+    static const std::map<std::string, UnicodeMethod> methods = {
+        { "none",    UnicodeMethod::None },
+        { "linux",   UnicodeMethod::Linux },
+        { "windows", UnicodeMethod::Windows },
+        { "macos",   UnicodeMethod::MacOS },
+    };
+
+    auto it = methods.find(name);
+    if (it == methods.end()) {
+        return false;
+    }
+    method = it->second;
+    return true;
+}
+
+/* The --unicode name of a method, as parse_unicode_method() accepts it */
+const char *unicode_method_name(UnicodeMethod method) {
+    switch (method) {
+    case UnicodeMethod::Linux:
+        return "linux";
+    case UnicodeMethod::Windows:
+        return "windows";
+    case UnicodeMethod::MacOS:
+        return "macos";
+    default:
+        return "none";
+    }
+}
+
+/*
+ * Types the code points a host's layout has no key for through the
+ * host OS's Unicode input method.
+ *
+ * Expanding a code point to its input sequence means formatting hex
+ * digits and looking every digit up in the layout, so each sequence is
+ * built once and cached; a document repeating the same few accented or
+ * CJK characters pays the expansion cost once per character. Instances
+ * are kept per host (see unicode_input_for_host()) and used from one
+ * typing thread at a time.
+ *
+ * A stroke with usage 0 in a sequence means "release everything": the
+ * Alt/Option based methods only commit the character once the modifier
+ * goes up, even if the next character holds it again.
+ */
+class UnicodeInputMethod {
+public:
+    UnicodeInputMethod(UnicodeMethod method, std::shared_ptr<const KeyboardLayout> layout)
+        : method_(method), layout_(std::move(layout)) {
+    }
+
+    UnicodeMethod method() const {
+        return method_;
+    }
+
+    const KeyboardLayout *layout() const {
+        return layout_.get();
+    }
+
+    /* Input sequence for cp, nullptr when the method can't type it */
+    const std::vector<KeyStroke> *strokes(uint32_t cp) {
+        auto it = cache_.find(cp);
+        if (it != cache_.end()) {
+            return it->second.empty() ? nullptr : &it->second;
+        }
+
+        /* Bound the memory a document full of distinct characters can pin */
+        if (cache_.size() >= max_cached_) {
+            cache_.clear();
+        }
+
+        std::vector<KeyStroke> &sequence = cache_[cp];
+        if (!expand(cp, sequence)) {
+            sequence.clear();
+            return nullptr;
+        }
+        return &sequence;
+    }
+
+private:
+    /* Append the layout strokes of each hex digit of value, adding modifier to them */
+    bool append_hex(uint32_t value, int digits, uint8_t modifier, bool numpad, std::vector<KeyStroke> &out) const {
+        static const char hex[] = "0123456789abcdef";
+        static const uint8_t numpad_digits[] = { 0x62, 0x59, 0x5A, 0x5B, 0x5C, 0x5D, 0x5E, 0x5F, 0x60, 0x61 };
+
+        for (int shift = (digits - 1) * 4; shift >= 0; shift -= 4) {
+            uint32_t nibble = (value >> shift) & 0xF;
+            if (numpad && nibble < 10) {
+                out.push_back({ numpad_digits[nibble], modifier });
+                continue;
+            }
+
+            size_t count;
+            const KeyStroke *stroke = lookup_strokes(layout_.get(), hex[nibble], count);
+            if (count != 1) {
+                return false;
+            }
+            out.push_back({ stroke->usage, static_cast<uint8_t>(stroke->modifier | modifier) });
+        }
+        return true;
+    }
+
+    bool expand(uint32_t cp, std::vector<KeyStroke> &out) const {
+        const KeyStroke release_all = { 0, 0 };
+        int digits = cp > 0xFFFF ? (cp > 0xFFFFF ? 6 : 5) : 4;
+
+        switch (method_) {
+        case UnicodeMethod::Linux: {
+            size_t count;
+            const KeyStroke *u = lookup_strokes(layout_.get(), 'u', count);
+            const KeyStroke *space = lookup_strokes(layout_.get(), ' ', count);
+            if (!u || !space) {
+                return false;
+            }
+            out.push_back({ u->usage, MOD_LEFTCTRL | MOD_LEFTSHIFT });
+            if (!append_hex(cp, digits, 0, false, out)) {
+                return false;
+            }
+            out.push_back(*space);
+            return true;
+        }
+
+        case UnicodeMethod::Windows:
+            out.push_back({ 0x57, MOD_LEFTALT });   /* Keypad + */
+            if (!append_hex(cp, digits, MOD_LEFTALT, true, out)) {
+                return false;
+            }
+            out.push_back(release_all);
+            return true;
+
+        case UnicodeMethod::MacOS:
+            if (cp > 0xFFFF) {
+                uint32_t v = cp - 0x10000;
+                if (!append_hex(0xD800 + (v >> 10), 4, MOD_LEFTALT, false, out) ||
+                    !append_hex(0xDC00 + (v & 0x3FF), 4, MOD_LEFTALT, false, out)) {
+                    return false;
+                }
+            } else if (!append_hex(cp, 4, MOD_LEFTALT, false, out)) {
+                return false;
+            }
+            out.push_back(release_all);
+            return true;
+
+        case UnicodeMethod::None:
+        default:
+            return false;
+        }
+    }
+
+    static constexpr size_t max_cached_ = 4096;
+
+    UnicodeMethod method_;
+    std::shared_ptr<const KeyboardLayout> layout_;
+    std::unordered_map<uint32_t, std::vector<KeyStroke>> cache_;
+};
+
+/* The host's input method, its cache survives reconnects as long as method and layout stay the same */
+std::shared_ptr<UnicodeInputMethod> unicode_input_for_host(const std::string &addr, UnicodeMethod method,
+                                                           const std::shared_ptr<const KeyboardLayout> &layout) {
+    static std::mutex mutex;
+    static std::map<std::string, std::shared_ptr<UnicodeInputMethod>> methods;
+
+    if (method == UnicodeMethod::None) {
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    std::shared_ptr<UnicodeInputMethod> &input = methods[addr];
+    if (!input || input->method() != method || input->layout() != layout.get()) {
+        input = std::make_shared<UnicodeInputMethod>(method, layout);
+    }
+    return input;
+}
+
+/*
+ * HID report descriptor, the bytes of SDP attribute 0x0206 in
+ * sdp_record.xml. The report packers below are generated from it, so a
+ * report added here gets a packer without a hand-written serializer.
+ */
+#define HID_REPORT_KEYBOARD 0x01
+#define HID_REPORT_MOUSE 0x02
+#define HID_REPORT_ABSOLUTE 0x03
+#define HID_REPORT_HIRES_MOUSE 0x04
+#define HID_REPORT_NKRO 0x05
+
+constexpr std::array<uint8_t, 303> hid_report_descriptor = {
+    0x05, 0x01,         /* Usage Page (Generic Desktop) */
+    0x09, 0x06,         /* Usage (Keyboard) */
+    0xA1, 0x01,         /* Collection (Application) */
+    0x85, 0x01,         /*   Report ID (1) */
+    0x75, 0x01,         /*   Report Size (1) */
+    0x95, 0x08,         /*   Report Count (8) */
+    0x05, 0x07,         /*   Usage Page (Keyboard) */
+    0x19, 0xE0,         /*   Usage Minimum (Left Control) */
+    0x29, 0xE7,         /*   Usage Maximum (Right GUI) */
+    0x15, 0x00,         /*   Logical Minimum (0) */
+    0x25, 0x01,         /*   Logical Maximum (1) */
+    0x81, 0x02,         /*   Input (Data, Variable, Absolute): modifier bits */
+    0x95, 0x01,         /*   Report Count (1) */
+    0x75, 0x08,         /*   Report Size (8) */
+    0x81, 0x03,         /*   Input (Constant): reserved byte */
+    0x95, 0x05,         /*   Report Count (5) */
+    0x75, 0x01,         /*   Report Size (1) */
+    0x05, 0x08,         /*   Usage Page (LEDs) */
+    0x19, 0x01,         /*   Usage Minimum (Num Lock) */
+    0x29, 0x05,         /*   Usage Maximum (Kana) */
+    0x91, 0x02,         /*   Output (Data, Variable, Absolute): LEDs */
+    0x95, 0x01,         /*   Report Count (1) */
+    0x75, 0x03,         /*   Report Size (3) */
+    0x91, 0x03,         /*   Output (Constant): padding */
+    0x95, 0x06,         /*   Report Count (6) */
+    0x75, 0x08,         /*   Report Size (8) */
+    0x15, 0x00,         /*   Logical Minimum (0) */
+    0x26, 0xFF, 0x00,   /*   Logical Maximum (255) */
+    0x05, 0x07,         /*   Usage Page (Keyboard) */
+    0x19, 0x00,         /*   Usage Minimum (0) */
+    0x29, 0xFF,         /*   Usage Maximum (255) */
+    0x81, 0x00,         /*   Input (Data, Array): 6 key slots */
+    0xC0,               /* End Collection */
+
+    0x05, 0x01,         /* Usage Page (Generic Desktop) */
+    0x09, 0x02,         /* Usage (Mouse) */
+    0xA1, 0x01,         /* Collection (Application) */
+    0x85, 0x02,         /*   Report ID (2) */
+    0x09, 0x01,         /*   Usage (Pointer) */
+    0xA1, 0x00,         /*   Collection (Physical) */
+    0x05, 0x09,         /*     Usage Page (Button) */
+    0x19, 0x01,         /*     Usage Minimum (1) */
+    0x29, 0x03,         /*     Usage Maximum (3) */
+    0x15, 0x00,         /*     Logical Minimum (0) */
+    0x25, 0x01,         /*     Logical Maximum (1) */
+    0x75, 0x01,         /*     Report Size (1) */
+    0x95, 0x03,         /*     Report Count (3) */
+    0x81, 0x02,         /*     Input (Data, Variable, Absolute): buttons */
+    0x75, 0x05,         /*     Report Size (5) */
+    0x95, 0x01,         /*     Report Count (1) */
+    0x81, 0x01,         /*     Input (Constant): padding */
+    0x05, 0x01,         /*     Usage Page (Generic Desktop) */
+    0x09, 0x30,         /*     Usage (X) */
+    0x09, 0x31,         /*     Usage (Y) */
+    0x09, 0x38,         /*     Usage (Wheel) */
+    0x15, 0x81,         /*     Logical Minimum (-127) */
+    0x25, 0x7F,         /*     Logical Maximum (127) */
+    0x75, 0x08,         /*     Report Size (8) */
+    0x95, 0x03,         /*     Report Count (3) */
+    0x81, 0x06,         /*     Input (Data, Variable, Relative) */
+    0xC0,               /*   End Collection */
+    0xC0,               /* End Collection */
+
+    0x05, 0x01,         /* Usage Page (Generic Desktop) */
+    0x09, 0x02,         /* Usage (Mouse) */
+    0xA1, 0x01,         /* Collection (Application) */
+    0x85, 0x03,         /*   Report ID (3) */
+    0x09, 0x01,         /*   Usage (Pointer) */
+    0xA1, 0x00,         /*   Collection (Physical) */
+    0x05, 0x09,         /*     Usage Page (Button) */
+    0x19, 0x01,         /*     Usage Minimum (1) */
+    0x29, 0x03,         /*     Usage Maximum (3) */
+    0x15, 0x00,         /*     Logical Minimum (0) */
+    0x25, 0x01,         /*     Logical Maximum (1) */
+    0x75, 0x01,         /*     Report Size (1) */
+    0x95, 0x03,         /*     Report Count (3) */
+    0x81, 0x02,         /*     Input (Data, Variable, Absolute): buttons */
+    0x75, 0x05,         /*     Report Size (5) */
+    0x95, 0x01,         /*     Report Count (1) */
+    0x81, 0x01,         /*     Input (Constant): padding */
+    0x05, 0x01,         /*     Usage Page (Generic Desktop) */
+    0x09, 0x30,         /*     Usage (X) */
+    0x09, 0x31,         /*     Usage (Y) */
+    0x15, 0x00,         /*     Logical Minimum (0) */
+    0x26, 0xFF, 0x7F,   /*     Logical Maximum (32767) */
+    0x75, 0x10,         /*     Report Size (16) */
+    0x95, 0x02,         /*     Report Count (2) */
+    0x81, 0x02,         /*     Input (Data, Variable, Absolute): screen position */
+    0xC0,               /*   End Collection */
+    0xC0,               /* End Collection */
+
+    0x05, 0x01,         /* Usage Page (Generic Desktop) */
+    0x09, 0x02,         /* Usage (Mouse) */
+    0xA1, 0x01,         /* Collection (Application) */
+    0x85, 0x04,         /*   Report ID (4) */
+    0x09, 0x01,         /*   Usage (Pointer) */
+    0xA1, 0x00,         /*   Collection (Physical) */
+    0x05, 0x09,         /*     Usage Page (Button) */
+    0x19, 0x01,         /*     Usage Minimum (1) */
+    0x29, 0x03,         /*     Usage Maximum (3) */
+    0x15, 0x00,         /*     Logical Minimum (0) */
+    0x25, 0x01,         /*     Logical Maximum (1) */
+    0x75, 0x01,         /*     Report Size (1) */
+    0x95, 0x03,         /*     Report Count (3) */
+    0x81, 0x02,         /*     Input (Data, Variable, Absolute): buttons */
+    0x75, 0x05,         /*     Report Size (5) */
+    0x95, 0x01,         /*     Report Count (1) */
+    0x81, 0x01,         /*     Input (Constant): padding */
+    0x05, 0x01,         /*     Usage Page (Generic Desktop) */
+    0x09, 0x30,         /*     Usage (X) */
+    0x09, 0x31,         /*     Usage (Y) */
+    0x16, 0x01, 0x80,   /*     Logical Minimum (-32767) */
+    0x26, 0xFF, 0x7F,   /*     Logical Maximum (32767) */
+    0x75, 0x10,         /*     Report Size (16) */
+    0x95, 0x02,         /*     Report Count (2) */
+    0x81, 0x06,         /*     Input (Data, Variable, Relative) */
+    0xA1, 0x02,         /*     Collection (Logical) */
+    0x09, 0x48,         /*       Usage (Resolution Multiplier) */
+    0x15, 0x00,         /*       Logical Minimum (0) */
+    0x25, 0x01,         /*       Logical Maximum (1) */
+    0x35, 0x01,         /*       Physical Minimum (1) */
+    0x45, 0x04,         /*       Physical Maximum (4) */
+    0x75, 0x02,         /*       Report Size (2) */
+    0x95, 0x01,         /*       Report Count (1) */
+    0xB1, 0x02,         /*       Feature (Data, Variable, Absolute) */
+    0x09, 0x38,         /*       Usage (Wheel) */
+    0x16, 0x01, 0x80,   /*       Logical Minimum (-32767) */
+    0x26, 0xFF, 0x7F,   /*       Logical Maximum (32767) */
+    0x35, 0x00,         /*       Physical Minimum (0) */
+    0x45, 0x00,         /*       Physical Maximum (0) */
+    0x75, 0x10,         /*       Report Size (16) */
+    0x95, 0x01,         /*       Report Count (1) */
+    0x81, 0x06,         /*       Input (Data, Variable, Relative) */
+    0xC0,               /*     End Collection */
+    0x75, 0x06,         /*     Report Size (6) */
+    0x95, 0x01,         /*     Report Count (1) */
+    0xB1, 0x03,         /*     Feature (Constant): padding */
+    0xC0,               /*   End Collection */
+    0xC0,               /* End Collection */
+
+    0x05, 0x01,         /* Usage Page (Generic Desktop) */
+    0x09, 0x06,         /* Usage (Keyboard) */
+    0xA1, 0x01,         /* Collection (Application) */
+    0x85, 0x05,         /*   Report ID (5) */
+    0x05, 0x07,         /*   Usage Page (Keyboard) */
+    0x19, 0xE0,         /*   Usage Minimum (Left Control) */
+    0x29, 0xE7,         /*   Usage Maximum (Right GUI) */
+    0x15, 0x00,         /*   Logical Minimum (0) */
+    0x25, 0x01,         /*   Logical Maximum (1) */
+    0x75, 0x01,         /*   Report Size (1) */
+    0x95, 0x08,         /*   Report Count (8) */
+    0x81, 0x02,         /*   Input (Data, Variable, Absolute): modifier bits */
+    0x19, 0x00,         /*   Usage Minimum (0) */
+    0x29, 0x9F,         /*   Usage Maximum (0x9F) */
+    0x95, 0xA0,         /*   Report Count (160) */
+    0x81, 0x02,         /*   Input (Data, Variable, Absolute): one bit per key */
+    0xC0,               /* End Collection */
+};
+
+/* Report types, numbered as in the HIDP GET_REPORT/SET_REPORT header */
+enum class HidReportType : uint8_t {
+    Input = 1,
+    Output = 2,
+    Feature = 3,
+};
+
+#define HID_FIELD_CONSTANT 0x01
+#define HID_FIELD_VARIABLE 0x02
+#define HID_FIELD_RELATIVE 0x04
+
+#define HID_MAX_FIELDS 64
+#define HID_MAX_REPORTS 16
+#define HID_MAX_USAGES 16
+
+/*
+ * One main item of a report. A variable field covers usage_min..usage_max,
+ * one element per usage, an array field has count slots each holding a
+ * usage of that range. bit_offset starts after the report ID byte.
+ */
+struct HidField {
+    uint8_t report_id;
+    HidReportType type;
+    uint8_t flags;
+    uint16_t usage_page;
+    uint16_t usage_min;
+    uint16_t usage_max;
+    uint16_t bit_offset;
+    uint8_t bit_size;
+    uint16_t count;
+    int32_t logical_min;
+    int32_t logical_max;
+};
+
+struct HidReportInfo {
+    uint8_t id;
+    HidReportType type;
+    uint16_t bits;
+};
+
+/* Bit position of one usage (or array) in a report */
+struct HidSlot {
+    bool found;
+    uint16_t bit_offset;
+    uint8_t bit_size;
+    uint16_t count;     /* Array slots, or 1-bit usages that follow in the same field */
+    bool is_signed;     /* Logical minimum below zero */
+};
+
+/* Report layout computed from a descriptor, fixed size so it works at compile time */
+struct HidDescriptorLayout {
+    std::array<HidField, HID_MAX_FIELDS> fields{};
+    size_t field_count = 0;
+    std::array<HidReportInfo, HID_MAX_REPORTS> reports{};
+    size_t report_count = 0;
+    const char *error = nullptr;    /* Why parsing stopped, nullptr on success */
+    size_t error_offset = 0;
+
+    /* Payload size of a report in bytes (without the report ID), 0 when it is not declared */
+    constexpr size_t report_bytes(uint8_t id, HidReportType type) const {
+        for (size_t i = 0; i < report_count; i++) {
+            if (reports[i].id == id && reports[i].type == type) {
+                return (reports[i].bits + 7) / 8;
+            }
+        }
+        return 0;
+    }
+
+    /* Variable field element carrying usage */
+    constexpr HidSlot usage_slot(uint8_t id, HidReportType type, uint16_t page, uint16_t usage) const {
+        for (size_t i = 0; i < field_count; i++) {
+            const HidField &field = fields[i];
+            if (field.report_id != id || field.type != type || field.usage_page != page ||
+                (field.flags & (HID_FIELD_CONSTANT | HID_FIELD_VARIABLE)) != HID_FIELD_VARIABLE ||
+                usage < field.usage_min || usage > field.usage_max || usage - field.usage_min >= field.count) {
+                continue;
+            }
+            uint16_t element = usage - field.usage_min;
+            uint16_t following = field.bit_size == 1 ? field.count - element : 1;
+            return { true, static_cast<uint16_t>(field.bit_offset + element * field.bit_size), field.bit_size, following,
+                     field.logical_min < 0 };
+        }
+        return { false, 0, 0, 0, false };
+    }
+
+    /* First array field of a usage page */
+    constexpr HidSlot array_slot(uint8_t id, HidReportType type, uint16_t page) const {
+        for (size_t i = 0; i < field_count; i++) {
+            const HidField &field = fields[i];
+            if (field.report_id == id && field.type == type && field.usage_page == page &&
+                (field.flags & (HID_FIELD_CONSTANT | HID_FIELD_VARIABLE)) == 0) {
+                return { true, field.bit_offset, field.bit_size, field.count, field.logical_min < 0 };
+            }
+        }
+        return { false, 0, 0, 0, false };
+    }
+};
+
+/*
+ * Parse the short items of a report descriptor into field offsets. Runs
+ * at compile time for hid_report_descriptor, and on the record loaded at
+ * startup without allocating.
+ */
+constexpr HidDescriptorLayout parse_hid_descriptor(const uint8_t *data, size_t len) {
+    struct GlobalState {
+        uint16_t usage_page = 0;
+        int32_t logical_min = 0;
+        int32_t logical_max = 0;
+        uint8_t report_size = 0;
+        uint8_t report_id = 0;
+        uint16_t report_count = 0;
+    };
+
+    HidDescriptorLayout layout;
+    GlobalState global;
+    GlobalState stack[4];
+    size_t stack_depth = 0;
+    uint16_t usages[HID_MAX_USAGES] = {};
+    size_t usage_count = 0;
+    uint16_t usage_min = 0;
+    uint16_t usage_max = 0;
+    bool has_range = false;
+    int collection_depth = 0;
+
+    auto fail = [&layout](const char *error, size_t offset) {
+        layout.error = error;
+        layout.error_offset = offset;
+        return layout;
+    };
+
+    size_t pos = 0;
+    while (pos < len) {
+        uint8_t prefix = data[pos];
+
+        /* Long items carry no report layout, skip them */
+        if (prefix == 0xFE) {
+            if (pos + 1 >= len) {
+                return fail("truncated long item", pos);
+            }
+            pos += 3 + data[pos + 1];
+            continue;
+        }
+
+        size_t size = (prefix & 0x03) == 3 ? 4 : prefix & 0x03;
+        uint8_t type = (prefix >> 2) & 0x03;
+        uint8_t tag = prefix >> 4;
+        if (pos + 1 + size > len) {
+            return fail("truncated item", pos);
+        }
+
+        uint32_t value = 0;
+        for (size_t i = 0; i < size; i++) {
+            value |= static_cast<uint32_t>(data[pos + 1 + i]) << (8 * i);
+        }
+        int32_t svalue = static_cast<int32_t>(value);
+        if (size == 1) {
+            svalue = static_cast<int8_t>(value);
+        } else if (size == 2) {
+            svalue = static_cast<int16_t>(value);
+        }
+
+        if (type == 0) {
+            /* Main item */
+            if (tag == 0x8 || tag == 0x9 || tag == 0xB) {
+                HidReportType report_type = tag == 0x8 ? HidReportType::Input
+                                          : tag == 0x9 ? HidReportType::Output : HidReportType::Feature;
+
+                HidReportInfo *report = nullptr;
+                for (size_t i = 0; i < layout.report_count; i++) {
+                    if (layout.reports[i].id == global.report_id && layout.reports[i].type == report_type) {
+                        report = &layout.reports[i];
+                    }
+                }
+                if (!report) {
+                    if (layout.report_count == HID_MAX_REPORTS) {
+                        return fail("too many reports", pos);
+                    }
+                    report = &layout.reports[layout.report_count++];
+                    *report = { global.report_id, report_type, 0 };
+                }
+
+                uint32_t bits = static_cast<uint32_t>(global.report_size) * global.report_count;
+                if (report->bits + bits > 0xFFFF) {
+                    return fail("report too long", pos);
+                }
+
+                /* A variable field with a usage list gets one field per listed usage */
+                bool variable = value & HID_FIELD_VARIABLE;
+                size_t parts = variable && !has_range && usage_count > 1 && !(value & HID_FIELD_CONSTANT) ? global.report_count : 1;
+                for (size_t part = 0; part < parts; part++) {
+                    if (layout.field_count == HID_MAX_FIELDS) {
+                        return fail("too many fields", pos);
+                    }
+
+                    HidField &field = layout.fields[layout.field_count++];
+                    field.report_id = global.report_id;
+                    field.type = report_type;
+                    field.flags = value & 0xFF;
+                    field.usage_page = global.usage_page;
+                    field.bit_size = global.report_size;
+                    field.logical_min = global.logical_min;
+                    field.logical_max = global.logical_max;
+                    if (parts > 1) {
+                        uint16_t usage = usages[part < usage_count ? part : usage_count - 1];
+                        field.usage_min = usage;
+                        field.usage_max = usage;
+                        field.count = 1;
+                        field.bit_offset = report->bits + part * global.report_size;
+                    } else {
+                        field.usage_min = has_range ? usage_min : usage_count > 0 ? usages[0] : 0;
+                        field.usage_max = has_range ? usage_max : usage_count > 0 ? usages[usage_count - 1] : 0;
+                        field.count = global.report_count;
+                        field.bit_offset = report->bits;
+                    }
+                }
+                report->bits += bits;
+            } else if (tag == 0xA) {
+                collection_depth++;
+            } else if (tag == 0xC) {
+                if (collection_depth == 0) {
+                    return fail("End Collection without Collection", pos);
+                }
+                collection_depth--;
+            }
+
+            /* Local items only apply to the next main item */
+            usage_count = 0;
+            has_range = false;
+        } else if (type == 1) {
+            /* Global item */
+            switch (tag) {
+            case 0x0: global.usage_page = value; break;
+            case 0x1: global.logical_min = svalue; break;
+            case 0x2:
+                /* An unsigned range written without a sign byte, e.g. 0..255 as 0xFF */
+                global.logical_max = global.logical_min >= 0 && svalue < global.logical_min ? value : svalue;
+                break;
+            case 0x7: global.report_size = value; break;
+            case 0x8: global.report_id = value; break;
+            case 0x9: global.report_count = value; break;
+            case 0xA:
+                if (stack_depth == 4) {
+                    return fail("Push too deep", pos);
+                }
+                stack[stack_depth++] = global;
+                break;
+            case 0xB:
+                if (stack_depth == 0) {
+                    return fail("Pop without Push", pos);
+                }
+                global = stack[--stack_depth];
+                break;
+            }
+        } else if (type == 2) {
+            /* Local item, a 4 byte usage carries its own usage page in the high half */
+            switch (tag) {
+            case 0x0:
+                if (usage_count == HID_MAX_USAGES) {
+                    return fail("too many usages", pos);
+                }
+                usages[usage_count++] = value & 0xFFFF;
+                break;
+            case 0x1: usage_min = value & 0xFFFF; has_range = true; break;
+            case 0x2: usage_max = value & 0xFFFF; has_range = true; break;
+            }
+        }
+
+        pos += 1 + size;
+    }
+
+    if (collection_depth != 0) {
+        return fail("unterminated Collection", len);
+    }
+    return layout;
+}
+
+constexpr HidDescriptorLayout hid_layout = parse_hid_descriptor(hid_report_descriptor.data(), hid_report_descriptor.size());
+
+static_assert(hid_layout.error == nullptr, "hid_report_descriptor does not parse");
+
+/* Usage page and id of a report field */
+struct HidUsage {
+    uint16_t page;
+    uint16_t id;
+};
+
+#define HID_PAGE_GENERIC_DESKTOP 0x01
+#define HID_PAGE_KEYBOARD 0x07
+#define HID_PAGE_LED 0x08
+#define HID_PAGE_BUTTON 0x09
+
+constexpr HidUsage HID_USAGE_X = { HID_PAGE_GENERIC_DESKTOP, 0x30 };
+constexpr HidUsage HID_USAGE_Y = { HID_PAGE_GENERIC_DESKTOP, 0x31 };
+constexpr HidUsage HID_USAGE_WHEEL = { HID_PAGE_GENERIC_DESKTOP, 0x38 };
+constexpr HidUsage HID_USAGE_RESOLUTION_MULTIPLIER = { HID_PAGE_GENERIC_DESKTOP, 0x48 };
+constexpr HidUsage HID_USAGE_LEFT_CTRL = { HID_PAGE_KEYBOARD, 0xE0 };
+constexpr HidUsage HID_USAGE_KEYBOARD_FIRST = { HID_PAGE_KEYBOARD, 0x00 };
+constexpr HidUsage HID_USAGE_BUTTON_1 = { HID_PAGE_BUTTON, 0x01 };
+constexpr HidUsage HID_USAGE_NUM_LOCK = { HID_PAGE_LED, 0x01 };
+
+/* Write the low bit_count bits of value at bit_offset, least significant bit first as HID orders them */
+constexpr void write_report_bits(uint8_t *payload, size_t bit_offset, size_t bit_count, uint32_t value) {
+    if (bit_offset % 8 == 0 && bit_count % 8 == 0) {
+        for (size_t i = 0; i < bit_count / 8; i++) {
+            payload[bit_offset / 8 + i] = static_cast<uint8_t>(value >> (8 * i));
+        }
+        return;
+    }
+    for (size_t i = 0; i < bit_count; i++) {
+        size_t bit = bit_offset + i;
+        uint8_t mask = static_cast<uint8_t>(1 << (bit % 8));
+        if ((value >> i) & 1) {
+            payload[bit / 8] |= mask;
+        } else {
+            payload[bit / 8] &= ~mask;
+        }
+    }
+}
+
+/* Read bit_count bits at bit_offset, sign extended when is_signed */
+constexpr int32_t read_report_bits(const uint8_t *payload, size_t bit_offset, size_t bit_count, bool is_signed) {
+    uint32_t value = 0;
+    for (size_t i = 0; i < bit_count; i++) {
+        size_t bit = bit_offset + i;
+        value |= static_cast<uint32_t>((payload[bit / 8] >> (bit % 8)) & 1) << i;
+    }
+    if (is_signed && bit_count < 32 && (value >> (bit_count - 1)) & 1) {
+        value |= ~0u << bit_count;
+    }
+    return static_cast<int32_t>(value);
+}
+
+/*
+ * Report with ID ReportId as carried by a HIDP DATA message (0xA0 | type,
+ * report ID, payload): input reports go out on the interrupt channel,
+ * output and feature reports are exchanged with the host. Size and field
+ * offsets come from hid_layout, a usage the descriptor doesn't declare in
+ * this report fails to compile.
+ */
+template<uint8_t ReportId, HidReportType Type>
+class HidReport {
+public:
+    static constexpr size_t payload_size = hid_layout.report_bytes(ReportId, Type);
+    static_assert(payload_size > 0, "hid_report_descriptor has no such report");
+    static constexpr size_t size = 2 + payload_size;
+
+    std::array<uint8_t, size> bytes{};
+
+    constexpr HidReport() {
+        bytes[0] = 0xA0 | static_cast<uint8_t>(Type);
+        bytes[1] = ReportId;
+    }
+
+    /* Report from the payload the host sent, missing bytes read as zero */
+    static constexpr HidReport from_payload(const uint8_t *data, size_t len) {
+        HidReport report;
+        for (size_t i = 0; i < len && i < payload_size; i++) {
+            report.bytes[2 + i] = data[i];
+        }
+        return report;
+    }
+
+    /* Value of a variable field, signed values are stored in two's complement */
+    template<HidUsage Usage>
+    constexpr HidReport &set(int32_t value) {
+        constexpr HidSlot slot = hid_layout.usage_slot(ReportId, Type, Usage.page, Usage.id);
+        static_assert(slot.found, "usage is not a variable field of this report");
+        write_report_bits(payload(), slot.bit_offset, slot.bit_size, static_cast<uint32_t>(value));
+        return *this;
+    }
+
+    /* Value of a variable field, sign extended when its logical minimum is negative */
+    template<HidUsage Usage>
+    constexpr int32_t get() const {
+        constexpr HidSlot slot = hid_layout.usage_slot(ReportId, Type, Usage.page, Usage.id);
+        static_assert(slot.found, "usage is not a variable field of this report");
+        return read_report_bits(bytes.data() + 2, slot.bit_offset, slot.bit_size, slot.is_signed);
+    }
+
+    /* Count 1-bit usages starting at First (modifiers, buttons), bit i of mask is usage First + i */
+    template<HidUsage First, size_t Count>
+    constexpr HidReport &set_bits(uint32_t mask) {
+        constexpr HidSlot slot = hid_layout.usage_slot(ReportId, Type, First.page, First.id);
+        static_assert(slot.found && slot.bit_size == 1 && slot.count >= Count, "usages are not consecutive bits of this report");
+        write_report_bits(payload(), slot.bit_offset, Count, mask);
+        return *this;
+    }
+
+    /* Bit of usage First + index in a run of Count 1-bit usages (a key bitmap) */
+    template<HidUsage First, size_t Count>
+    constexpr HidReport &set_bit(size_t index, bool value) {
+        constexpr HidSlot slot = hid_layout.usage_slot(ReportId, Type, First.page, First.id);
+        static_assert(slot.found && slot.bit_size == 1 && slot.count >= Count, "usages are not consecutive bits of this report");
+        if (index < Count) {
+            write_report_bits(payload(), slot.bit_offset + index, 1, value);
+        }
+        return *this;
+    }
+
+    template<HidUsage First, size_t Count>
+    constexpr uint32_t get_bits() const {
+        constexpr HidSlot slot = hid_layout.usage_slot(ReportId, Type, First.page, First.id);
+        static_assert(slot.found && slot.bit_size == 1 && slot.count >= Count, "usages are not consecutive bits of this report");
+        return static_cast<uint32_t>(read_report_bits(bytes.data() + 2, slot.bit_offset, Count, false));
+    }
+
+    /* Slot index of the array field of usage page Page */
+    template<uint16_t Page>
+    constexpr HidReport &set_array(size_t index, uint16_t usage) {
+        constexpr HidSlot slot = hid_layout.array_slot(ReportId, Type, Page);
+        static_assert(slot.found, "usage page has no array field in this report");
+        if (index < slot.count) {
+            write_report_bits(payload(), slot.bit_offset + index * slot.bit_size, slot.bit_size, usage);
+        }
+        return *this;
+    }
+
+    /* Number of slots of the array field of usage page Page */
+    template<uint16_t Page>
+    static constexpr size_t array_size() {
+        return hid_layout.array_slot(ReportId, Type, Page).count;
+    }
+
+private:
+    constexpr uint8_t *payload() {
+        return bytes.data() + 2;
+    }
+};
+
+template<uint8_t ReportId>
+using HidInputReport = HidReport<ReportId, HidReportType::Input>;
+
+template<uint8_t ReportId>
+using HidOutputReport = HidReport<ReportId, HidReportType::Output>;
+
+template<uint8_t ReportId>
+using HidFeatureReport = HidReport<ReportId, HidReportType::Feature>;
+
+using KeyboardInputReport = HidInputReport<HID_REPORT_KEYBOARD>;
+using KeyboardOutputReport = HidOutputReport<HID_REPORT_KEYBOARD>;
+using MouseInputReport = HidInputReport<HID_REPORT_MOUSE>;
+using AbsoluteInputReport = HidInputReport<HID_REPORT_ABSOLUTE>;
+using HiresMouseInputReport = HidInputReport<HID_REPORT_HIRES_MOUSE>;
+using HiresMouseFeatureReport = HidFeatureReport<HID_REPORT_HIRES_MOUSE>;
+using NkroInputReport = HidInputReport<HID_REPORT_NKRO>;
+
+#define NKRO_KEY_COUNT 160      /* Keys 0x00..0x9F have a bit in the NKRO report */
+
+#define MOUSE_MAX_DELTA 127     /* Logical range of the relative axes is -127..127 */
+#define ABSOLUTE_MAX 32767      /* Logical maximum of the absolute X/Y axes */
+#define HIRES_MAX_DELTA 32767   /* Logical range of the high resolution axes is -32767..32767 */
+
+constexpr KeyboardInputReport keyboard_input_report(uint8_t modifier, const std::array<uint8_t, 6> &keys) {
+    KeyboardInputReport report;
+    report.set_bits<HID_USAGE_LEFT_CTRL, 8>(modifier);
+    for (size_t i = 0; i < keys.size(); i++) {
+        report.set_array<HID_PAGE_KEYBOARD>(i, keys[i]);
+    }
+    return report;
+}
+
+constexpr MouseInputReport mouse_input_report(uint8_t buttons, const std::array<int8_t, 3> &rel_move) {
+    MouseInputReport report;
+    report.set_bits<HID_USAGE_BUTTON_1, 3>(buttons)
+          .set<HID_USAGE_X>(rel_move[0])
+          .set<HID_USAGE_Y>(rel_move[1])
+          .set<HID_USAGE_WHEEL>(rel_move[2]);
+    return report;
+}
+
+/* x, y in 0..ABSOLUTE_MAX, from the left/top edge of the screen to the right/bottom */
+constexpr AbsoluteInputReport absolute_input_report(uint8_t buttons, uint16_t x, uint16_t y) {
+    AbsoluteInputReport report;
+    report.set_bits<HID_USAGE_BUTTON_1, 3>(buttons)
+          .set<HID_USAGE_X>(std::min<uint16_t>(x, ABSOLUTE_MAX))
+          .set<HID_USAGE_Y>(std::min<uint16_t>(y, ABSOLUTE_MAX));
+    return report;
+}
+
+constexpr HiresMouseInputReport hires_mouse_input_report(uint8_t buttons, int16_t dx, int16_t dy, int16_t wheel) {
+    HiresMouseInputReport report;
+    report.set_bits<HID_USAGE_BUTTON_1, 3>(buttons)
+          .set<HID_USAGE_X>(dx)
+          .set<HID_USAGE_Y>(dy)
+          .set<HID_USAGE_WHEEL>(wheel);
+    return report;
+}
+
+/* Any number of keys down at once, usages past the bitmap (0x9F) can't be sent and are skipped */
+template<typename Keys>
+constexpr NkroInputReport nkro_input_report(uint8_t modifier, const Keys &keys) {
+    NkroInputReport report;
+    report.set_bits<HID_USAGE_LEFT_CTRL, 8>(modifier);
+    for (uint8_t key : keys) {
+        if (key != 0) {
+            report.set_bit<HID_USAGE_KEYBOARD_FIRST, NKRO_KEY_COUNT>(key, true);
+        }
+    }
+    return report;
+}
+
+static_assert(KeyboardInputReport::size == 10 && KeyboardInputReport::array_size<HID_PAGE_KEYBOARD>() == 6,
+              "keyboard report: modifiers, reserved byte, 6 key slots");
+static_assert(MouseInputReport::size == 6, "mouse report: buttons, X, Y, wheel");
+static_assert(keyboard_input_report(MOD_LEFTSHIFT, { 0x04, 0x05, 0, 0, 0, 0 }).bytes ==
+              std::array<uint8_t, 10>{ 0xA1, 0x01, 0x02, 0x00, 0x04, 0x05, 0x00, 0x00, 0x00, 0x00 },
+              "keyboard report byte layout");
+static_assert(mouse_input_report(0x05, { -1, 2, -127 }).bytes ==
+              std::array<uint8_t, 6>{ 0xA1, 0x02, 0x05, 0xFF, 0x02, 0x81 },
+              "mouse report byte layout");
+static_assert(absolute_input_report(0x01, 0x1234, ABSOLUTE_MAX).bytes ==
+              std::array<uint8_t, 7>{ 0xA1, 0x03, 0x01, 0x34, 0x12, 0xFF, 0x7F },
+              "absolute pointer report byte layout");
+static_assert(hires_mouse_input_report(0x02, -2, 0x1234, 1).bytes ==
+              std::array<uint8_t, 9>{ 0xA1, 0x04, 0x02, 0xFE, 0xFF, 0x34, 0x12, 0x01, 0x00 },
+              "high resolution mouse report byte layout");
+static_assert(HiresMouseFeatureReport::size == 3 &&
+              HiresMouseFeatureReport::from_payload(std::array<uint8_t, 1>{ 0x01 }.data(), 1).get<HID_USAGE_RESOLUTION_MULTIPLIER>() == 1,
+              "resolution multiplier feature report");
+static_assert(KeyboardOutputReport::size == 3, "keyboard output report: 5 LEDs, padding");
+static_assert(NkroInputReport::size == 2 + 1 + NKRO_KEY_COUNT / 8, "NKRO report: modifiers, key bitmap");
+static_assert(nkro_input_report(MOD_LEFTCTRL, std::array<uint8_t, 3>{ 0x04, 0x0A, 0x9F }).bytes ==
+              std::array<uint8_t, 23>{ 0xA1, 0x05, 0x01, 0x10, 0x04, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x80 },
+              "NKRO report byte layout");
+
+#define INTERRUPT_STALL_TIMEOUT_MS 10000  /* A host not draining the queue this long counts as gone */
+#define INTERRUPT_WAIT_MS 2                 /* Sleep between looks at a full send window */
+
+/*
+ * Bytes of socket memory the interrupt channel may hold before reports
+ * are held back, set from the command line. Reports queued in the kernel
+ * add latency when the radio link slows down; keeping the queue this
+ * short bounds it to a few reports.
+ */
+unsigned interrupt_send_window = 4096;
+
+enum class ReportPolicy {
+    KeepOrdered,    /* Keys and buttons: wait for room, every report is sent in order */
+    DropStale,      /* Pointer state: not queued behind a full window, a newer report supersedes it */
+};
+
+struct InterruptStats {
+    std::atomic<uint64_t> stalls{0};    /* Reports that had to wait for the window */
+    std::atomic<uint64_t> dropped{0};   /* DropStale reports not sent */
+    std::atomic<uint64_t> timeouts{0};  /* KeepOrdered reports given up after INTERRUPT_STALL_TIMEOUT_MS */
+};
+
+InterruptStats interrupt_stats;
+
+/*
+ * Socket memory taken by reports not yet handed to the controller.
+ * SIOCOUTQ (TIOCOUTQ) reports queued bytes on most sockets, but on
+ * Bluetooth sockets it returns the free space left in the send buffer,
+ * subtracted from the SO_SNDBUF read at connect. One ioctl per report.
+ * Returns -1 when the socket can't tell.
+ */
+int interrupt_queued_bytes(const BluetoothConnection &conn) {
+    int value;
+    if (ioctl(conn.interrupt_client, TIOCOUTQ, &value) < 0) {
+        return -1;
+    }
+    return conn.interrupt_sndbuf > 0 ? std::max(conn.interrupt_sndbuf - value, 0) : value;
+}
+
+bool interrupt_window_full(const BluetoothConnection &conn) {
+    return interrupt_queued_bytes(conn) >= static_cast<int>(interrupt_send_window);
+}
+
+/*
+ * Write one report to the non-blocking interrupt socket. KeepOrdered
+ * waits while the send window is full and fails with ETIMEDOUT after
+ * INTERRUPT_STALL_TIMEOUT_MS. DropStale fails right away with EAGAIN.
+ */
+bool send_interrupt_report(const BluetoothConnection &conn, const uint8_t *report, size_t len,
+                           ReportPolicy policy = ReportPolicy::KeepOrdered) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(INTERRUPT_STALL_TIMEOUT_MS);
+    bool stalled = false;
+
+    while (true) {
+        bool full = interrupt_window_full(conn);
+        if (!full) {
+            if (write(conn.interrupt_client, report, len) >= 0) {
+                return true;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                return false;
+            }
+        }
+
+        if (policy == ReportPolicy::DropStale) {
+            interrupt_stats.dropped++;
+            errno = EAGAIN;
+            return false;
+        }
+        if (!stalled) {
+            stalled = true;
+            interrupt_stats.stalls++;
+        }
+        if (std::chrono::steady_clock::now() >= deadline) {
+            interrupt_stats.timeouts++;
+            errno = ETIMEDOUT;
+            return false;
+        }
+
+        if (full) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(INTERRUPT_WAIT_MS));
+        } else {
+            struct pollfd pfd = { conn.interrupt_client, POLLOUT, 0 };
+            poll(&pfd, 1, INTERRUPT_WAIT_MS);
+        }
+    }
+}
+
+/*
+ * What the host last received and set, so GET_REPORT on the control
+ * channel answers with the current state. Relative axes are not state:
+ * a mouse report read back only carries the buttons held.
+ */
+struct HidHostState {
+    KeyboardInputReport keyboard = keyboard_input_report(0, {});
+    NkroInputReport nkro = nkro_input_report(0, std::array<uint8_t, 0>{});
+    uint8_t buttons = 0;
+    uint16_t absolute_x = 0;
+    uint16_t absolute_y = 0;
+    uint8_t leds = 0;           /* LED bits of output report 1, Num Lock first */
+    uint8_t idle_rate = 0;      /* SET_IDLE in 4 ms units, 0 reports on change only */
+    uint64_t led_reports = 0;   /* LED output reports received */
+    int64_t led_report_ns = 0;  /* CLOCK_MONOTONIC arrival of the last one */
+    bool suspended = false;     /* Host sent HID_CONTROL SUSPEND */
+    bool unplugged = false;     /* Host sent HID_CONTROL VIRTUAL_CABLE_UNPLUG */
+};
+
+std::mutex host_state_mutex;
+std::condition_variable host_leds_changed;     /* Notified on every LED output report */
+HidHostState host_state;
+
+/* New connection: nothing held, nothing set by the host yet */
+void reset_host_state() {
+    std::lock_guard<std::mutex> lock(host_state_mutex);
+    host_state = HidHostState();
+}
+
+void record_mouse_buttons(uint8_t buttons) {
+    std::lock_guard<std::mutex> lock(host_state_mutex);
+    host_state.buttons = buttons;
+}
+
+#define HID_LED_CAPS_LOCK 0x02  /* Caps Lock bit of HidHostState::leds */
+#define HID_LED_SCROLL_LOCK 0x04
+
+bool host_caps_lock() {
+    std::lock_guard<std::mutex> lock(host_state_mutex);
+    return host_state.leds & HID_LED_CAPS_LOCK;
+}
+
+/* Print every mouse report sent (--log-mouse) */
+bool log_mouse_reports = false;
+
+/*
+ * Protocol mode set by the host with SET_PROTOCOL. A BIOS or other boot
+ * host does not parse the report descriptor and only understands the
+ * fixed boot reports: keyboard report 1 already has the boot layout, the
+ * mouse shrinks to buttons, X and Y. Every connection starts in report
+ * protocol.
+ */
+enum class HidProtocol : uint8_t {
+    Boot = 0,
+    Report = 1,
+};
+
+std::atomic<HidProtocol> hid_protocol{HidProtocol::Report};
+
+bool boot_protocol_active() {
+    return hid_protocol.load() == HidProtocol::Boot;
+}
+
+/* Boot protocol mouse report: 0xA1, report ID 2, buttons 1-3, X, Y */
+constexpr std::array<uint8_t, 5> boot_mouse_report(uint8_t buttons, int8_t dx, int8_t dy) {
+    return { 0xA1, HID_REPORT_MOUSE, static_cast<uint8_t>(buttons & 0x07),
+             static_cast<uint8_t>(dx), static_cast<uint8_t>(dy) };
+}
+
+static_assert(boot_mouse_report(0x0D, -1, 2) == std::array<uint8_t, 5>{ 0xA1, 0x02, 0x05, 0xFF, 0x02 },
+              "boot mouse report byte layout");
+
+bool send_boot_mouse(const BluetoothConnection &conn, uint8_t buttons, int8_t dx, int8_t dy) {
+    std::array<uint8_t, 5> report = boot_mouse_report(buttons, dx, dy);
+    if (!send_interrupt_report(conn, report.data(), report.size())) {
+        perror("Error sending mouse report to interrupt channel");
+        return false;
+    }
+    record_mouse_buttons(buttons);
+
+    if (log_mouse_reports) {
+        std::cout << "Sending boot mouse report -> Buttons: " << (int)buttons
+                  << ", X: " << (int)dx << ", Y: " << (int)dy << std::endl;
+    }
+    return true;
+}
+
+bool send_keys(const BluetoothConnection &conn, uint8_t modifier_byte, const std::array<uint8_t, 6> &keys) {
+    /* Keyboard input report (ID 1): 10 bytes
+     *   0  : 0xA1, HID input report prefix
+     *   1  : Report ID
+     *   2  : Modifier bits (Ctrl, Shift, Alt, GUI, left then right)
+     *   3  : Reserved, always zero
+     * 4 - 9: Usages of up to 6 keys held down
+     */
+    KeyboardInputReport report = keyboard_input_report(modifier_byte, keys);
+
+    /* Send HID Report through interupt channel */
+    if (!send_interrupt_report(conn, report.bytes.data(), report.bytes.size())) {
+        return false;
+    } else {
+        std::lock_guard<std::mutex> lock(host_state_mutex);
+        host_state.keyboard = report;
+        return true;
+    }
+}
+
+bool send_mouse(const BluetoothConnection &conn, uint8_t buttons, const std::array<int8_t, 3> &rel_move) {
+    /* 
+     * Mouse HID Report Format (ID 2), after the 0xA1 prefix and report ID
+     * Byte 0: Buttons 1-3
+     * Byte 1: X movement (relative)
+     * Byte 2: Y movement (relative)
+     * Byte 3: Wheel movement 
+     */
+
+    /* Check connection is available? */
+    if (conn.interrupt_client <= 0) {
+        std::cerr << "Interrupt client socket not connected!" << std::endl;
+        return false;
+    }
+
+    /* Boot hosts get no wheel */
+    if (boot_protocol_active()) {
+        return send_boot_mouse(conn, buttons, rel_move[0], rel_move[1]);
+    }
+
+    MouseInputReport report = mouse_input_report(buttons, rel_move);
+
+    /* Send data report through interrupt socket */
+    if (!send_interrupt_report(conn, report.bytes.data(), report.bytes.size())) {
+        perror("Error sending mouse report to interrupt channel");
+        return false;
+    }
+    record_mouse_buttons(buttons);
+
+    /* Debug - optional */
+    if (log_mouse_reports) {
+        std::cout << "Sending mouse report -> "
+                  << "Buttons: " << (int)buttons
+                  << ", X: " << (int)rel_move[0]
+                  << ", Y: " << (int)rel_move[1]
+                  << ", Wheel: " << (int)rel_move[2]
+                  << std::endl;
+    }
+
+    return true;
+}
+
+/*
+ * Put the pointer at a normalized screen position in one report:
+ * x, y from 0.0 (left/top) to 1.0 (right/bottom), clamped to that range.
+ */
+bool send_absolute(const BluetoothConnection &conn, uint8_t buttons, float x, float y) {
+    if (boot_protocol_active()) {
+        std::cerr << "Absolute pointer is not available in boot protocol" << std::endl;
+        return false;
+    }
+
+    auto scale = [](float value) {
+        return static_cast<uint16_t>(std::lround(std::clamp(value, 0.0f, 1.0f) * ABSOLUTE_MAX));
+    };
+    AbsoluteInputReport report = absolute_input_report(buttons, scale(x), scale(y));
+
+    /* A position that can't go now is stale by the time the window drains */
+    if (!send_interrupt_report(conn, report.bytes.data(), report.bytes.size(), ReportPolicy::DropStale)) {
+        perror("Error sending pointer report to interrupt channel");
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(host_state_mutex);
+        host_state.buttons = buttons;
+        host_state.absolute_x = scale(x);
+        host_state.absolute_y = scale(y);
+    }
+
+    if (log_mouse_reports) {
+        std::cout << "Sending pointer report -> Buttons: " << (int)buttons
+                  << ", X: " << x << ", Y: " << y << std::endl;
+    }
+    return true;
+}
+
+enum class MouseMode {
+    Standard,   /* Report ID 2, 8-bit axes */
+    HighRes,    /* Report ID 4, 16-bit axes, high resolution wheel */
+};
+
+/* Relative mouse report used for motion, set from the command line */
+MouseMode mouse_mode = MouseMode::Standard;
+
+/*
+ * Resolution Multiplier of the high resolution wheel as last set by the
+ * host through feature report 4: 0 is one unit per detent, 1 is four.
+ */
+std::atomic<uint8_t> wheel_resolution_multiplier{0};
+
+/* Largest delta one relative report of the current mode carries */
+int32_t mouse_max_delta() {
+    if (boot_protocol_active()) {
+        return MOUSE_MAX_DELTA;
+    }
+    return mouse_mode == MouseMode::HighRes ? HIRES_MAX_DELTA : MOUSE_MAX_DELTA;
+}
+
+/* Wheel units of one detent, hosts that enabled the multiplier expect a quarter detent per unit */
+int32_t wheel_units_per_detent() {
+    return mouse_mode == MouseMode::HighRes && wheel_resolution_multiplier.load() ? 4 : 1;
+}
+
+/* Feature report 4 as the host reads it with GET_REPORT */
+HiresMouseFeatureReport hires_feature_report() {
+    HiresMouseFeatureReport report;
+    report.set<HID_USAGE_RESOLUTION_MULTIPLIER>(wheel_resolution_multiplier.load());
+    return report;
+}
+
+/* Apply feature report 4 from a SET_REPORT payload (without the report ID) */
+void set_hires_feature_report(const uint8_t *payload, size_t len) {
+    HiresMouseFeatureReport report = HiresMouseFeatureReport::from_payload(payload, len);
+    wheel_resolution_multiplier = report.get<HID_USAGE_RESOLUTION_MULTIPLIER>();
+    std::cout << "[Mouse] Wheel resolution multiplier " << wheel_units_per_detent() << std::endl;
+}
+
+bool send_hires_mouse(const BluetoothConnection &conn, uint8_t buttons, int16_t dx, int16_t dy, int16_t wheel) {
+    if (boot_protocol_active()) {
+        auto clamp = [](int16_t delta) {
+            return static_cast<int8_t>(std::clamp<int16_t>(delta, -MOUSE_MAX_DELTA, MOUSE_MAX_DELTA));
+        };
+        return send_boot_mouse(conn, buttons, clamp(dx), clamp(dy));
+    }
+
+    HiresMouseInputReport report = hires_mouse_input_report(buttons, dx, dy, wheel);
+
+    if (!send_interrupt_report(conn, report.bytes.data(), report.bytes.size())) {
+        perror("Error sending mouse report to interrupt channel");
+        return false;
+    }
+    record_mouse_buttons(buttons);
+
+    if (log_mouse_reports) {
+        std::cout << "Sending hi-res mouse report -> Buttons: " << (int)buttons
+                  << ", X: " << dx << ", Y: " << dy << ", Wheel: " << wheel << std::endl;
+    }
+    return true;
+}
+
+/* Relative motion in the report of the current mode, deltas within mouse_max_delta() */
+bool send_mouse_motion(const BluetoothConnection &conn, uint8_t buttons, int32_t dx, int32_t dy, int32_t wheel) {
+    if (mouse_mode == MouseMode::HighRes) {
+        return send_hires_mouse(conn, buttons, dx, dy, wheel);
+    }
+    return send_mouse(conn, buttons, { static_cast<int8_t>(dx), static_cast<int8_t>(dy), static_cast<int8_t>(wheel) });
+}
+
+/*
+ * Paces reports on absolute CLOCK_MONOTONIC deadlines.
+ *
+ * Sleeping for a relative duration after each write() lets wake-up lag
+ * and write time accumulate, so a long paste drifts far from the requested
+ * rate. Here every report gets its own deadline (previous deadline + delay)
+ * and the thread sleeps with clock_nanosleep(TIMER_ABSTIME), so a late
+ * wake-up shortens the next wait instead of pushing every later report.
+ * If we fall more than max_lag behind (e.g. the process was stopped) the
+ * schedule is re-anchored to now rather than bursting to catch up.
+ */
+struct SchedulerStats {
+    uint64_t reports = 0;
+    int64_t total_lateness_ns = 0;
+    int64_t max_lateness_ns = 0;
+    int64_t last_lateness_ns = 0;
+    uint64_t resyncs = 0;
+};
+
+int64_t monotonic_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+class ReportScheduler {
+public:
+    explicit ReportScheduler(int64_t max_lag_ns = 100000000LL) : max_lag_ns_(max_lag_ns) {
+        restart();
+    }
+
+    /* Anchor the schedule at the current time and clear the statistics */
+    void restart() {
+        start_ns_ = deadline_ns_ = monotonic_now_ns();
+        stats_ = SchedulerStats();
+    }
+
+    /*
+     * Advance the deadline by delay and sleep until it.
+     * Returns how late (ns) the thread woke up relative to that deadline.
+     */
+    int64_t wait_next(float delay_sec) {
+        deadline_ns_ += static_cast<int64_t>(delay_sec * 1e9f);
+
+        struct timespec ts;
+        ts.tv_sec = deadline_ns_ / 1000000000LL;
+        ts.tv_nsec = deadline_ns_ % 1000000000LL;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+        }
+
+        int64_t lateness = monotonic_now_ns() - deadline_ns_;
+        if (lateness < 0) {
+            lateness = 0;
+        }
+
+        stats_.reports++;
+        stats_.total_lateness_ns += lateness;
+        stats_.last_lateness_ns = lateness;
+        stats_.max_lateness_ns = std::max(stats_.max_lateness_ns, lateness);
+
+        if (lateness > max_lag_ns_) {
+            deadline_ns_ += lateness;
+            stats_.resyncs++;
+        }
+        return lateness;
+    }
+
+    const SchedulerStats &stats() const {
+        return stats_;
+    }
+
+    int64_t elapsed_ns() const {
+        return monotonic_now_ns() - start_ns_;
+    }
+
+private:
+    int64_t max_lag_ns_;
+    int64_t start_ns_ = 0;
+    int64_t deadline_ns_ = 0;
+    SchedulerStats stats_;
+};
+
+#define TYPING_RATE_MIN 10.0f           /* Key reports per second */
+#define TYPING_RATE_MAX 250.0f          /* Keeps every key down for at least 4 ms */
+#define TYPING_RATE_START 40.0f
+#define TYPING_RATE_INCREASE 20.0f      /* Reports per second gained each second without backlog */
+#define TYPING_RATE_DECREASE 0.5f       /* Rate kept when backlog appears */
+
+/*
+ * Additive increase, multiplicative decrease pacing of key reports.
+ *
+ * Fixed key_down_time/key_delay are too slow for a clean link and too
+ * fast for a congested one. The pacer looks at the interrupt send queue
+ * just before each report: socket memory still queued from earlier
+ * reports after a full interval means the link drains slower than we
+ * send, as does a write that had to wait for the send window. Then the
+ * rate is cut by TYPING_RATE_DECREASE, once per congestion episode, and
+ * otherwise grows linearly with time. Every report is then spaced by
+ * the current interval.
+ */
+class TypingPacer {
+public:
+    explicit TypingPacer(float rate = TYPING_RATE_START) : rate_(std::clamp(rate, TYPING_RATE_MIN, TYPING_RATE_MAX)) {
+    }
+
+    /* Queue left by earlier reports, sampled right before the next write */
+    void before_send(const BluetoothConnection &conn) {
+        queued_ = interrupt_queued_bytes(conn);
+        stalls_ = interrupt_stats.stalls.load();
+    }
+
+    /* Update the rate once the report is written, returns the seconds to wait before the next */
+    float after_send() {
+        bool backlog = queued_ >= static_cast<int>(interrupt_send_window / 4) ||
+                       interrupt_stats.stalls.load() != stalls_;
+        float rate = rate_.load();
+
+        if (backlog) {
+            if (!congested_) {
+                congested_ = true;
+                rate = std::max(rate * TYPING_RATE_DECREASE, TYPING_RATE_MIN);
+                decreases_++;
+            }
+        } else {
+            congested_ = false;
+            rate = std::min(rate + TYPING_RATE_INCREASE / rate, TYPING_RATE_MAX);
+        }
+        rate_ = rate;
+        return 1.0f / rate;
+    }
+
+    float rate() const {
+        return rate_.load();
+    }
+
+    uint64_t decreases() const {
+        return decreases_.load();
+    }
+
+private:
+    std::atomic<float> rate_;
+    std::atomic<uint64_t> decreases_{0};
+    int queued_ = 0;
+    uint64_t stalls_ = 0;
+    bool congested_ = false;
+};
+
+/* Keyboard input report contents, as passed to send_keys() */
+struct KeyReport {
+    uint8_t modifier = 0;
+    std::array<uint8_t, 6> keys = { 0, 0, 0, 0, 0, 0 };
+};
+
+constexpr KeyReport stroke_report(const KeyStroke &stroke) {
+    KeyReport report;
+    report.modifier = stroke.modifier;
+    report.keys[0] = stroke.usage;
+    return report;
+}
+
+/*
+ * Key-down events a host derives from the transition before -> after.
+ * Modifiers are applied first, then the key array is walked slot by slot
+ * and every usage that wasn't already down is a new key press, in slot
+ * order (Linux hid-input and Windows kbdhid both process the 6KRO array
+ * this way). Returns the number of usages written to downs.
+ */
+constexpr size_t host_key_downs(const KeyReport &before, const KeyReport &after, std::array<uint8_t, 6> &downs) {
+    size_t count = 0;
+    for (uint8_t key : after.keys) {
+        if (key == 0) {
+            continue;
+        }
+        bool held = false;
+        for (uint8_t old_key : before.keys) {
+            held = held || old_key == key;
+        }
+        if (!held) {
+            downs[count++] = key;
+        }
+    }
+    return count;
+}
+
+/* Whether going from before to after presses every key of after, in slot order */
+constexpr bool keys_pressed_in_order(const KeyReport &before, const KeyReport &after) {
+    std::array<uint8_t, 6> downs = { 0, 0, 0, 0, 0, 0 };
+    host_key_downs(before, after, downs);
+    for (size_t i = 0; i < after.keys.size(); i++) {
+        if (downs[i] != after.keys[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Keyboard state last reported to the host.
+ *
+ * Typing used to cost a press report plus an all-zero release report per
+ * character, with Shift pressed and released around every capital. The
+ * tracker emits state transitions only: the next key replaces the previous
+ * one in a single report and modifiers stay held across a run of
+ * characters sharing them. A release is needed only when a usage that is
+ * down is pressed again (the host would see no new key down) or typing stops.
+ */
+class KeyStateTracker {
+public:
+    constexpr const KeyReport &state() const {
+        return state_;
+    }
+
+    constexpr bool is_released() const {
+        return state_.modifier == 0 && state_.keys[0] == 0;
+    }
+
+    /* Report pressing next, replacing whatever is currently down */
+    constexpr const KeyReport &press(const KeyReport &next) {
+        state_ = next;
+        return state_;
+    }
+
+    /* Whether a release has to be reported before next (nullptr = end of typing) */
+    constexpr bool needs_release(const KeyReport *next) const {
+        if (!next) {
+            return !is_released();
+        }
+        for (uint8_t key : state_.keys) {
+            for (uint8_t next_key : next->keys) {
+                if (key != 0 && key == next_key) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    /* Report releasing every key, keeping held the modifiers next needs */
+    constexpr const KeyReport &release(const KeyReport *next) {
+        state_.modifier = next ? next->modifier : 0;
+        state_.keys = { 0, 0, 0, 0, 0, 0 };
+        return state_;
+    }
+
+private:
+    KeyReport state_;
+};
+
+enum class KeyboardMode {
+    Standard,   /* Report ID 1, 6 key slots */
+    Nkro,       /* Report ID 5, a bit per key */
+};
+
+bool parse_keyboard_mode(const std::string &name, KeyboardMode &mode) {
+    if (name == "6kro") {
+        mode = KeyboardMode::Standard;
+    } else if (name == "nkro") {
+        mode = KeyboardMode::Nkro;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+struct TypingOptions {
+    float key_down_time = 0.01;     /* Seconds a report's keys stay down */
+    float key_delay = 0.05;         /* Seconds from the release slot to the next press */
+    bool burst = false;             /* Pack up to 6 characters into one report */
+    KeyboardMode keyboard_mode = KeyboardMode::Standard;
+    std::shared_ptr<const KeyboardLayout> layout;   /* Host keyboard layout, nullptr = US */
+    UnicodeMethod unicode_method = UnicodeMethod::None;
+    std::shared_ptr<UnicodeInputMethod> unicode;    /* Types what layout has no key for */
+    bool caps_lock = false;         /* Host has Caps Lock on, from its LED output report */
+    bool adaptive_rate = true;      /* Pace with TypingPacer instead of key_down_time/key_delay */
+};
+
+/* Defaults for new typing jobs, set from the command line */
+TypingOptions typing_options;
+
+/* Layout name per remote bdaddr ("AA:BB:CC:DD:EE:FF"), overrides typing_options.layout */
+std::map<std::string, std::string> host_layouts;
+
+/* Unicode input method per remote bdaddr, overrides typing_options.unicode_method */
+std::map<std::string, UnicodeMethod> host_unicode_methods;
+
+/* Keyboard report per remote bdaddr, overrides typing_options.keyboard_mode */
+std::map<std::string, KeyboardMode> host_keyboard_modes;
+
+/* Mouse reports per second, set from the command line */
+unsigned mouse_report_rate = 125;
+
+/* Mouse reports per second per remote bdaddr, overrides mouse_report_rate */
+std::map<std::string, unsigned> host_mouse_rates;
+
+#define PROFILE_DB_PATH "/var/lib/bluetooth/hid-client.db"
+#define PROFILE_DB_MAGIC "HIDH"
+#define PROFILE_DB_VERSION 1
+#define PROFILE_DB_SLOTS 256        /* Hosts remembered, a power of two */
+#define PROFILE_DB_PROBE 16         /* Slots tried from a host's hash before evicting */
+
+/* HostProfileRecord::fields, which values the record holds */
+#define PROFILE_TYPING_RATE 0x01
+#define PROFILE_KEYBOARD_MODE 0x02
+#define PROFILE_LAYOUT 0x04
+#define PROFILE_MOUSE_RATE 0x08
+#define PROFILE_UNICODE_METHOD 0x10
+
+/* PROFILE_* bits of the global options given on the command line, saved settings don't override them */
+uint8_t command_line_fields = 0;
+
+/*
+ * Host profile database: this header followed by PROFILE_DB_SLOTS fixed
+ * size records, an open addressing hash table on the bdaddr. The file is
+ * mapped read-write, so finding a host is a hash and a few compares, and
+ * an update is a store into the mapping.
+ */
+struct ProfileDbHeader {
+    char magic[4];          /* PROFILE_DB_MAGIC */
+    uint16_t version;
+    uint16_t header_size;
+    uint32_t slot_count;
+    uint32_t record_size;
+};
+
+struct HostProfileRecord {
+    uint8_t bdaddr[6];      /* Slot is free when all zero */
+    uint8_t fields;         /* PROFILE_* */
+    uint8_t keyboard_mode;  /* KeyboardMode */
+    uint8_t unicode_method; /* UnicodeMethod */
+    uint8_t reserved;
+    uint16_t mouse_rate;    /* Reports per second */
+    float typing_rate;      /* Key reports per second TypingPacer last reached */
+    uint32_t connections;
+    uint32_t last_seen;     /* Unix time of the last connection */
+    char layout[40];        /* As given to --host-layout, NUL terminated */
+};
+
+static_assert(sizeof(ProfileDbHeader) == 16, "ProfileDbHeader must match the file format");
+static_assert(sizeof(HostProfileRecord) == 64, "HostProfileRecord must match the file format");
+
+class HostProfileDb {
+public:
+    /* Open path, creating an empty database when it doesn't exist */
+    static std::unique_ptr<HostProfileDb> open(const std::string &path) {
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (fd < 0) {
+            std::cerr << "Cannot open host profiles " << path << ": " << strerror(errno) << std::endl;
+            return nullptr;
+        }
+
+        const size_t size = sizeof(ProfileDbHeader) + PROFILE_DB_SLOTS * sizeof(HostProfileRecord);
+        struct stat st;
+        bool created = fstat(fd, &st) == 0 && st.st_size == 0;
+        if (created && ftruncate(fd, size) < 0) {
+            std::cerr << "Cannot size host profiles " << path << ": " << strerror(errno) << std::endl;
+            close(fd);
+            return nullptr;
+        } else if (!created && static_cast<size_t>(st.st_size) != size) {
+            std::cerr << "Host profiles " << path << " have an unexpected size" << std::endl;
+            close(fd);
+            return nullptr;
+        }
+
+        void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+            std::cerr << "Cannot map host profiles " << path << ": " << strerror(errno) << std::endl;
+            return nullptr;
+        }
+
+        std::unique_ptr<HostProfileDb> db(new HostProfileDb(map, size));
+        ProfileDbHeader &header = *static_cast<ProfileDbHeader *>(map);
+        if (created) {
+            memcpy(header.magic, PROFILE_DB_MAGIC, 4);
+            header.version = PROFILE_DB_VERSION;
+            header.header_size = sizeof(ProfileDbHeader);
+            header.slot_count = PROFILE_DB_SLOTS;
+            header.record_size = sizeof(HostProfileRecord);
+            db->sync();
+        } else if (memcmp(header.magic, PROFILE_DB_MAGIC, 4) != 0 || header.version != PROFILE_DB_VERSION ||
+                   header.header_size != sizeof(ProfileDbHeader) || header.slot_count != PROFILE_DB_SLOTS ||
+                   header.record_size != sizeof(HostProfileRecord)) {
+            std::cerr << "Host profiles " << path << " have a bad header" << std::endl;
+            return nullptr;
+        }
+        return db;
+    }
+
+    ~HostProfileDb() {
+        msync(map_, size_, MS_SYNC);
+        munmap(map_, size_);
+    }
+
+    HostProfileDb(const HostProfileDb &) = delete;
+    HostProfileDb &operator=(const HostProfileDb &) = delete;
+
+    /*
+     * Record of addr, nullptr when the host is unknown. With create an
+     * unknown host gets a free slot, or the least recently seen one of
+     * its probe window when none is free.
+     */
+    HostProfileRecord *find(const bdaddr_t &addr, bool create) {
+        static const uint8_t free_slot[6] = { 0 };
+        if (memcmp(addr.b, free_slot, 6) == 0) {
+            return nullptr;
+        }
+
+        /* FNV-1a over the address */
+        uint32_t hash = 2166136261u;
+        for (uint8_t byte : addr.b) {
+            hash = (hash ^ byte) * 16777619u;
+        }
+
+        HostProfileRecord *empty = nullptr;
+        HostProfileRecord *oldest = nullptr;
+        for (uint32_t i = 0; i < PROFILE_DB_PROBE; i++) {
+            HostProfileRecord &record = records_[(hash + i) & (PROFILE_DB_SLOTS - 1)];
+            if (memcmp(record.bdaddr, addr.b, 6) == 0) {
+                return &record;
+            }
+            if (memcmp(record.bdaddr, free_slot, 6) == 0) {
+                /* Records are never removed, nothing lies past a free slot */
+                empty = &record;
+                break;
+            }
+            if (!oldest || record.last_seen < oldest->last_seen) {
+                oldest = &record;
+            }
+        }
+
+        if (!create) {
+            return nullptr;
+        }
+        HostProfileRecord *record = empty ? empty : oldest;
+        *record = HostProfileRecord();
+        memcpy(record->bdaddr, addr.b, 6);
+        return record;
+    }
+
+    void sync() {
+        msync(map_, size_, MS_ASYNC);
+    }
+
+private:
+    HostProfileDb(void *map, size_t size)
+        : map_(map), size_(size),
+          records_(reinterpret_cast<HostProfileRecord *>(static_cast<uint8_t *>(map) + sizeof(ProfileDbHeader))) {
+    }
+
+    void *map_;
+    size_t size_;
+    HostProfileRecord *records_;
+};
+
+/* Path of the database, "none" to run without one; set from the command line */
+std::string host_profile_path = PROFILE_DB_PATH;
+
+/* Opened at startup, nullptr when it couldn't be */
+std::unique_ptr<HostProfileDb> host_profiles;
+
+HostProfileRecord *host_profile(const BluetoothConnection &conn) {
+    return host_profiles ? host_profiles->find(conn.remote_addr, false) : nullptr;
+}
+
+std::string remote_address(const BluetoothConnection &conn) {
+    char addr[18] = { 0 };
+    ba2str(&conn.remote_addr, addr);
+    return addr;
+}
+
+/* Typing options for the host behind conn */
+TypingOptions typing_options_for_host(const BluetoothConnection &conn) {
+    TypingOptions options = typing_options;
+    std::string addr = remote_address(conn);
+
+    /* Saved settings first, the command line overrides them */
+    const HostProfileRecord *profile = host_profile(conn);
+    if (profile) {
+        uint8_t fields = profile->fields & ~command_line_fields;
+        if (fields & PROFILE_LAYOUT) {
+            options.layout = get_layout(std::string(profile->layout, strnlen(profile->layout, sizeof(profile->layout))));
+        }
+        if ((fields & PROFILE_UNICODE_METHOD) && profile->unicode_method <= static_cast<uint8_t>(UnicodeMethod::MacOS)) {
+            options.unicode_method = static_cast<UnicodeMethod>(profile->unicode_method);
+        }
+        if ((fields & PROFILE_KEYBOARD_MODE) && profile->keyboard_mode <= static_cast<uint8_t>(KeyboardMode::Nkro)) {
+            options.keyboard_mode = static_cast<KeyboardMode>(profile->keyboard_mode);
+        }
+    }
+
+    auto layout = host_layouts.find(addr);
+    if (layout != host_layouts.end()) {
+        options.layout = get_layout(layout->second);
+    }
+
+    auto method = host_unicode_methods.find(addr);
+    if (method != host_unicode_methods.end()) {
+        options.unicode_method = method->second;
+    }
+    options.unicode = unicode_input_for_host(addr, options.unicode_method, options.layout);
+
+    auto keyboard_mode = host_keyboard_modes.find(addr);
+    if (keyboard_mode != host_keyboard_modes.end()) {
+        options.keyboard_mode = keyboard_mode->second;
+    }
+    return options;
+}
+
+/* Mouse report rate for the host behind conn */
+unsigned mouse_rate_for_host(const BluetoothConnection &conn) {
+    auto rate = host_mouse_rates.find(remote_address(conn));
+    if (rate != host_mouse_rates.end()) {
+        return rate->second;
+    }
+    const HostProfileRecord *profile = host_profile(conn);
+    if (profile && (profile->fields & ~command_line_fields & PROFILE_MOUSE_RATE) && profile->mouse_rate > 0) {
+        return profile->mouse_rate;
+    }
+    return mouse_report_rate;
+}
+
+/* Typing rate the pacer starts at: what this host sustained last time */
+float typing_rate_for_host(const BluetoothConnection &conn) {
+    const HostProfileRecord *profile = host_profile(conn);
+    if (profile && (profile->fields & PROFILE_TYPING_RATE) && std::isfinite(profile->typing_rate)) {
+        return profile->typing_rate;
+    }
+    return TYPING_RATE_START;
+}
+
+/* Count the connection and save the settings the command line gives for this host */
+void remember_host(const BluetoothConnection &conn) {
+    HostProfileRecord *profile = host_profiles ? host_profiles->find(conn.remote_addr, true) : nullptr;
+    if (!profile) {
+        return;
+    }
+    std::string addr = remote_address(conn);
+    profile->connections++;
+    profile->last_seen = static_cast<uint32_t>(time(nullptr));
+
+    auto layout = host_layouts.find(addr);
+    if (layout != host_layouts.end() && layout->second.size() < sizeof(profile->layout)) {
+        memset(profile->layout, 0, sizeof(profile->layout));
+        memcpy(profile->layout, layout->second.data(), layout->second.size());
+        profile->fields |= PROFILE_LAYOUT;
+    }
+    auto method = host_unicode_methods.find(addr);
+    if (method != host_unicode_methods.end()) {
+        profile->unicode_method = static_cast<uint8_t>(method->second);
+        profile->fields |= PROFILE_UNICODE_METHOD;
+    }
+    auto keyboard_mode = host_keyboard_modes.find(addr);
+    if (keyboard_mode != host_keyboard_modes.end()) {
+        profile->keyboard_mode = static_cast<uint8_t>(keyboard_mode->second);
+        profile->fields |= PROFILE_KEYBOARD_MODE;
+    }
+    auto mouse_rate = host_mouse_rates.find(addr);
+    if (mouse_rate != host_mouse_rates.end()) {
+        profile->mouse_rate = static_cast<uint16_t>(mouse_rate->second);
+        profile->fields |= PROFILE_MOUSE_RATE;
+    }
+    host_profiles->sync();
+}
+
+/* Save the typing rate the connection ended at, the next one starts there */
+void remember_typing_rate(const BluetoothConnection &conn, float rate) {
+    HostProfileRecord *profile = host_profile(conn);
+    if (!profile) {
+        return;
+    }
+    profile->typing_rate = rate;
+    profile->fields |= PROFILE_TYPING_RATE;
+    host_profiles->sync();
+}
+
+/* Drop saved settings of the host behind conn, PROFILE_* bits; they apply until it reconnects */
+bool forget_host_fields(const BluetoothConnection &conn, uint8_t fields) {
+    HostProfileRecord *profile = host_profile(conn);
+    if (!profile) {
+        return false;
+    }
+    profile->fields &= ~fields;
+    host_profiles->sync();
+    return true;
+}
+
+bool send_nkro_report(const BluetoothConnection &conn, const NkroInputReport &report) {
+    if (!send_interrupt_report(conn, report.bytes.data(), report.bytes.size())) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(host_state_mutex);
+    host_state.nkro = report;
+    return true;
+}
+
+bool send_nkro_keys(const BluetoothConnection &conn, uint8_t modifier_byte, const std::array<uint8_t, 6> &keys) {
+    return send_nkro_report(conn, nkro_input_report(modifier_byte, keys));
+}
+
+/* Boot hosts only parse report 1, NKRO falls back to it while boot protocol is active */
+KeyboardMode active_keyboard_mode(KeyboardMode mode) {
+    return boot_protocol_active() ? KeyboardMode::Standard : mode;
+}
+
+/* Keyboard state in the report of mode */
+bool send_key_report(const BluetoothConnection &conn, const KeyReport &report, KeyboardMode mode) {
+    if (active_keyboard_mode(mode) == KeyboardMode::Nkro) {
+        return send_nkro_keys(conn, report.modifier, report.keys);
+    }
+    return send_keys(conn, report.modifier, report.keys);
+}
+
+/*
+ * Move modifier usages (0xE0..0xE7) of a chord into its modifier byte
+ * and check the other keys fit the report of mode: 6 keys in 6KRO mode,
+ * usages up to 0x9F in NKRO mode. Says why when they don't.
+ */
+bool fit_chord(uint8_t &modifier, std::vector<uint8_t> &usages, KeyboardMode mode) {
+    std::vector<uint8_t> keys;
+    for (uint8_t usage : usages) {
+        if (usage >= HID_USAGE_LEFT_CTRL.id && usage < HID_USAGE_LEFT_CTRL.id + 8) {
+            modifier |= 1 << (usage - HID_USAGE_LEFT_CTRL.id);
+        } else if (mode == KeyboardMode::Nkro && usage >= NKRO_KEY_COUNT) {
+            std::cerr << "Usage 0x" << std::hex << unsigned(usage) << std::dec
+                      << " has no key in the NKRO report (0x00..0x9F)" << std::endl;
+            return false;
+        } else {
+            keys.push_back(usage);
+        }
+    }
+    if (mode != KeyboardMode::Nkro && keys.size() > 6) {
+        std::cerr << "A chord of " << keys.size() << " keys needs --keyboard-mode nkro" << std::endl;
+        return false;
+    }
+    usages = std::move(keys);
+    return true;
+}
+
+/*
+ * Press every key of usages at once with modifier held, keep them down
+ * for hold seconds and release them. The chord must pass fit_chord().
+ */
+bool send_chord(const BluetoothConnection &conn, uint8_t modifier, const std::vector<uint8_t> &usages,
+                const TypingOptions &options = typing_options, float hold = 0.05f) {
+    bool sent;
+    if (active_keyboard_mode(options.keyboard_mode) == KeyboardMode::Nkro) {
+        sent = send_nkro_report(conn, nkro_input_report(modifier, usages));
+    } else {
+        KeyReport report;
+        report.modifier = modifier;
+        std::copy(usages.begin(), usages.end(), report.keys.begin());
+        sent = send_keys(conn, report.modifier, report.keys);
+    }
+    if (!sent) {
+        return false;
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<float>(hold));
+    return send_key_report(conn, KeyReport(), options.keyboard_mode);
+}
+
+struct TypedStroke {
+    KeyStroke stroke;
+    size_t end;             /* Text offset fully typed once this stroke is sent */
+    bool burstable;         /* The character is this single stroke, it may share a report */
+};
+
+#define KEY_CAPS_LOCK 0x39
+
+/* Letters Caps Lock shifts: ASCII and Latin-1 letters that have an upper and a lower case */
+constexpr bool caps_lock_letter(uint32_t cp) {
+    if (cp < 0x80) {
+        return (cp >= 'a' && cp <= 'z') || (cp >= 'A' && cp <= 'Z');
+    }
+    return cp >= 0xC0 && cp <= 0xFE && cp != 0xD7 && cp != 0xDF && cp != 0xF7;
+}
+
+/*
+ * Turns UTF-8 text into the keystrokes typing it on a host using layout
+ * (nullptr = built-in US ascii_keymap). Characters the layout has no keys
+ * for go through the host's Unicode input method when there is one,
+ * otherwise they are skipped with a warning. With caps_lock set letters
+ * typed with Shift alone or no modifier get Shift inverted, as the host
+ * inverts it back.
+ */
+class StrokeStream {
+public:
+    StrokeStream(const std::string &text, const KeyboardLayout *layout, UnicodeInputMethod *unicode = nullptr,
+                 bool caps_lock = false)
+        : text_(text), layout_(layout), unicode_(unicode), caps_lock_(caps_lock) {
+    }
+
+    bool peek(TypedStroke &stroke) {
+        if (!fill()) {
+            return false;
+        }
+        bool last = seq_index_ + 1 == seq_count_;
+        stroke = { seq_[seq_index_], last ? char_end_ : char_start_, seq_count_ == 1 };
+        return true;
+    }
+
+    bool next(TypedStroke &stroke) {
+        if (!peek(stroke)) {
+            return false;
+        }
+        seq_index_++;
+        return true;
+    }
+
+private:
+    /* Make sure the current character has strokes left, decoding the next one if needed */
+    bool fill() {
+        while (seq_index_ >= seq_count_) {
+            if (pos_ >= text_.size()) {
+                return false;
+            }
+
+            uint32_t cp;
+            size_t len = utf8_decode(text_, pos_, cp);
+            if (len == 0) {
+                cp = 0xFFFD;
+                len = text_.size() - pos_;
+            }
+            char_start_ = pos_;
+            char_end_ = pos_ + len;
+            pos_ = char_end_;
+
+            seq_index_ = 0;
+            seq_ = lookup_strokes(layout_, cp, seq_count_);
+
+            const uint8_t shift = MOD_LEFTSHIFT | MOD_RIGHTSHIFT;
+            if (caps_lock_ && seq_count_ == 1 && caps_lock_letter(cp) && (seq_[0].modifier & ~shift) == 0) {
+                caps_stroke_ = { seq_[0].usage, static_cast<uint8_t>(seq_[0].modifier ? 0 : MOD_LEFTSHIFT) };
+                seq_ = &caps_stroke_;
+            }
+
+            /* Control characters and decoding errors are never worth an input method sequence */
+            bool printable = cp >= 0x20 && !(cp >= 0x7F && cp < 0xA0) && cp != 0xFFFD;
+            if (seq_count_ == 0 && unicode_ && printable) {
+                const std::vector<KeyStroke> *sequence = unicode_->strokes(cp);
+                if (sequence) {
+                    seq_ = sequence->data();
+                    seq_count_ = sequence->size();
+                }
+            }
+
+            if (seq_count_ == 0) {
+                std::cerr << "Skipping unsupported character U+" << std::hex << cp << std::dec << std::endl;
+            }
+        }
+        return true;
+    }
+
+    const std::string &text_;
+    const KeyboardLayout *layout_;
+    UnicodeInputMethod *unicode_;
+    bool caps_lock_;
+    size_t pos_ = 0;
+    KeyStroke caps_stroke_ = { 0, 0 };  /* Letter stroke with Shift inverted for Caps Lock */
+
+    const KeyStroke *seq_ = nullptr;    /* Strokes of the current character */
+    size_t seq_count_ = 0;
+    size_t seq_index_ = 0;
+    size_t char_start_ = 0;
+    size_t char_end_ = 0;
+};
+
+/* Characters sent together in one keyboard report */
+struct KeyGroup {
+    KeyReport report;
+    size_t end;             /* Text offset fully typed once the report is sent */
+};
+
+/*
+ * Take the next report worth of strokes, false once strokes is exhausted.
+ *
+ * Without burst a group is one stroke. In burst mode following
+ * single-stroke characters join it while they share the modifier state,
+ * use a usage not yet in the group and a slot is free, so the host sees
+ * them pressed in text order within a single report (see host_key_downs()).
+ * Dead key sequences are never packed.
+ */
+bool next_key_group(StrokeStream &strokes, bool burst, KeyGroup &group, bool ascending = false) {
+    TypedStroke first;
+    if (!strokes.next(first)) {
+        return false;
+    }
+
+    group = { stroke_report(first.stroke), first.end };
+    size_t count = 1;
+
+    TypedStroke stroke;
+    while (burst && first.burstable && count < group.report.keys.size() && strokes.peek(stroke)) {
+        if (!stroke.burstable || stroke.stroke.modifier != first.stroke.modifier) {
+            break;
+        }
+
+        /* A bitmap report reaches the host in usage order, not slot order */
+        if (ascending && stroke.stroke.usage < group.report.keys[count - 1]) {
+            break;
+        }
+
+        bool duplicate = false;
+        for (size_t i = 0; i < count; i++) {
+            duplicate = duplicate || group.report.keys[i] == stroke.stroke.usage;
+        }
+        if (duplicate) {
+            break;
+        }
+
+        strokes.next(stroke);
+        group.report.keys[count++] = stroke.stroke.usage;
+        group.end = stroke.end;
+    }
+    return true;
+}
+
+/*
+ * Translate text into keyboard reports for a host whose Caps Lock is
+ * caps_lock. Each report gets a press slot and, key_down_time later, a
+ * release slot; KeyStateTracker decides which slots actually need a report.
+ * emit(report, delay, typed) is called for every report with the seconds to
+ * wait after sending it and the number of bytes of text fully typed once it
+ * is sent, returning false stops the translation. When cancel is given it
+ * is checked before every report. Returns the number of bytes of text
+ * fully typed.
+ */
+template <typename Emit>
+size_t translate_strokes(const std::string &text, const TypingOptions &options, bool caps_lock,
+                         const std::atomic<bool> *cancel, Emit emit) {
+    size_t consumed = 0;
+
+    KeyStateTracker tracker;
+    StrokeStream strokes(text, options.layout.get(), options.unicode.get(), caps_lock);
+    KeyGroup next;
+    bool ascending = options.keyboard_mode == KeyboardMode::Nkro;
+    bool has_next = next_key_group(strokes, options.burst, next, ascending);
+    bool stopped = false;
+    bool failed = false;    /* A report wasn't sent, the link is gone */
+
+    while (has_next) {
+        if (cancel && cancel->load()) {
+            stopped = true;
+            break;
+        }
+
+        KeyGroup group = next;
+
+        /* Look ahead, the next group decides whether this one needs a release */
+        has_next = next_key_group(strokes, options.burst, next, ascending);
+        const KeyReport *next_report = has_next ? &next.report : nullptr;
+
+        /*
+         * The host must see exactly the group's keys go down, in slot order.
+         * The release logic already guarantees that, a state that
+         * somehow doesn't is released first rather than risk reordering.
+         */
+        if (!keys_pressed_in_order(tracker.state(), group.report)) {
+            if (!emit(tracker.release(&group.report), 0.0f, consumed)) {
+                stopped = failed = true;
+                break;
+            }
+        }
+
+        const KeyReport &pressed = tracker.press(group.report);
+
+        /* Release keys, only when the next group can't replace them directly */
+        bool release = tracker.needs_release(next_report);
+
+        if (!emit(pressed, release ? options.key_down_time : options.key_down_time + options.key_delay, group.end)) {
+            stopped = failed = true;
+            break;
+        }
+        consumed = group.end;
+
+        if (release && !emit(tracker.release(next_report), options.key_delay, consumed)) {
+            stopped = failed = true;
+            break;
+        }
+    }
+
+    if (!stopped) {
+        consumed = text.size();
+    }
+
+    /* Cancelled in the middle of a run, don't leave keys held on the host; after a failed write it would only wait again */
+    if (!failed && !tracker.is_released()) {
+        emit(tracker.release(nullptr), 0.0f, consumed);
+    }
+    return consumed;
+}
+
+/* Reports of a text typed in bursts with the host's Caps Lock off and on, see next_key_group() */
+struct BurstReports {
+    size_t caps_off = 0;
+    size_t caps_on = 0;
+    bool letters = false;   /* The text has letters Caps Lock shifts */
+};
+
+/* Burst group being filled while counting, and the one before it */
+struct OpenGroup {
+    int modifier = -1;      /* -1 when there is no group to join */
+    std::array<uint8_t, 6> keys{};
+    size_t count = 0;
+    std::array<uint8_t, 6> previous{};
+    bool released = false;  /* A key of the previous group is pressed again, it had to be released */
+    size_t reports = 0;
+
+    void add(uint8_t mod, uint8_t usage, bool ascending) {
+        bool joins = modifier == mod && count < keys.size() && (!ascending || usage > keys[count - 1]) &&
+                     std::find(keys.begin(), keys.begin() + count, usage) == keys.begin() + count;
+        if (!joins) {
+            previous = modifier < 0 ? std::array<uint8_t, 6>{} : keys;
+            keys = {};
+            modifier = mod;
+            count = 0;
+            released = false;
+            reports++;
+        }
+        keys[count++] = usage;
+        if (!released && std::find(previous.begin(), previous.end(), usage) != previous.end()) {
+            released = true;
+            reports++;
+        }
+    }
+};
+
+/*
+ * Count the reports text takes in either Caps Lock state, in one pass
+ * over the layout's strokes: a press per burst group plus a release
+ * where a group presses a key of the one before. Nothing else typing
+ * does happens here, no warnings for missing characters and no input
+ * method sequences. Characters that aren't a single stroke cost the
+ * same in both states and only end the groups around them.
+ */
+BurstReports count_burst_reports(const std::string &text, const KeyboardLayout *layout, bool ascending) {
+    const uint8_t shift = MOD_LEFTSHIFT | MOD_RIGHTSHIFT;
+    BurstReports result;
+    OpenGroup off;
+    OpenGroup on;
+
+    for (size_t pos = 0; pos < text.size();) {
+        uint32_t cp;
+        size_t len = utf8_decode(text, pos, cp);
+        if (len == 0) {
+            break;
+        }
+        pos += len;
+
+        size_t count;
+        const KeyStroke *strokes = lookup_strokes(layout, cp, count);
+        if (count != 1) {
+            off.modifier = on.modifier = -1;
+            continue;
+        }
+
+        uint8_t modifier = strokes[0].modifier;
+        uint8_t caps_modifier = modifier;
+        if (caps_lock_letter(cp) && (modifier & ~shift) == 0) {
+            caps_modifier = modifier ? 0 : MOD_LEFTSHIFT;
+            result.letters = true;
+        }
+        off.add(modifier, strokes[0].usage, ascending);
+        on.add(caps_modifier, strokes[0].usage, ascending);
+    }
+    result.caps_off = off.reports;
+    result.caps_on = on.reports;
+    return result;
+}
+
+/* Reports a Caps Lock switch costs: press and release, once to switch and once to restore */
+#define CAPS_LOCK_SWITCH_REPORTS 4
+
+/*
+ * Translate text into keyboard reports, see translate_strokes(), typing
+ * letters right whatever options.caps_lock says the host has.
+ *
+ * Letters are typed with Shift inverted while Caps Lock is on. Without
+ * burst every character is its own report whatever its modifiers, but a
+ * burst group ends where Shift changes, so a run of capitals typed with
+ * Caps Lock on (or lowercase with it off) packs better. When the other
+ * Caps Lock state saves more reports than switching costs, Caps Lock
+ * is pressed first and pressed again after the text to restore the host.
+ */
+template <typename Emit>
+size_t translate_text(const std::string &text, const TypingOptions &options, const std::atomic<bool> *cancel, Emit emit) {
+    bool caps_lock = options.caps_lock;
+    bool switch_caps = false;
+    if (options.burst) {
+        BurstReports reports = count_burst_reports(text, options.layout.get(), options.keyboard_mode == KeyboardMode::Nkro);
+        size_t current = caps_lock ? reports.caps_on : reports.caps_off;
+        size_t other = caps_lock ? reports.caps_off : reports.caps_on;
+        switch_caps = reports.letters && other + CAPS_LOCK_SWITCH_REPORTS < current;
+    }
+    if (!switch_caps) {
+        return translate_strokes(text, options, caps_lock, cancel, emit);
+    }
+
+    KeyReport caps_key;
+    caps_key.keys[0] = KEY_CAPS_LOCK;
+    if (!emit(caps_key, options.key_down_time, 0) || !emit(KeyReport(), options.key_delay, 0)) {
+        return 0;
+    }
+
+    bool failed = false;
+    size_t consumed = translate_strokes(text, options, !caps_lock, cancel,
+                                        [&](const KeyReport &report, float delay, size_t typed) {
+        failed = !emit(report, delay, typed);
+        return !failed;
+    });
+
+    /* Also after a cancel, the host gets its Caps Lock back; not over a link that just failed */
+    if (!failed && emit(caps_key, options.key_down_time, consumed)) {
+        emit(KeyReport(), options.key_delay, consumed);
+    }
+    return consumed;
+}
+
+/*
+ * Type text on the host, reports are paced by scheduler (a local one when
+ * none is given), at the rate of pacer instead of the options' delays
+ * when one is given. Typing stops at the first failed write, with link_lost
+ * set. Returns the number of bytes of text typed, for a stopped job that
+ * is up to the last report the host received.
+ */
+size_t send_string_input(const BluetoothConnection &conn, const std::string &text, const TypingOptions &options = TypingOptions(),
+                         const std::atomic<bool> *cancel = nullptr, ReportScheduler *scheduler = nullptr,
+                         bool *link_lost = nullptr, TypingPacer *pacer = nullptr) {
+    ReportScheduler local_scheduler;
+    if (!scheduler) {
+        scheduler = &local_scheduler;
+    }
+
+    TypingOptions host_options = options;
+    host_options.caps_lock = host_caps_lock();
+
+    return translate_text(text, host_options, cancel, [&](const KeyReport &report, float delay, size_t) {
+        if (pacer) {
+            pacer->before_send(conn);
+        }
+        if (!send_key_report(conn, report, options.keyboard_mode)) {
+            if (link_lost) {
+                *link_lost = true;
+            }
+            return false;
+        }
+        scheduler->wait_next(pacer ? pacer->after_send() : delay);
+        return true;
+    });
+}
+
+/* A keyboard input report exactly as send_keys() writes it */
+using PackedKeyReport = std::array<uint8_t, KeyboardInputReport::size>;
+
+constexpr PackedKeyReport packed_key_report(const KeyReport &report) {
+    return keyboard_input_report(report.modifier, report.keys).bytes;
+}
+
+/* send_keys() for a report already packed, GET_REPORT answers with it afterwards */
+bool send_packed_key_report(const BluetoothConnection &conn, const PackedKeyReport &packed) {
+    if (!send_interrupt_report(conn, packed.data(), packed.size())) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(host_state_mutex);
+    host_state.keyboard.bytes = packed;
+    return true;
+}
+
+/* Report of a character of a constant key string, not a constant expression when it has no key */
+constexpr KeyReport constant_key_report(char c) {
+    uint8_t index = static_cast<uint8_t>(c);
+    if (index >= ascii_keymap.size() || ascii_keymap[index].usage == 0) {
+        throw "character has no key on the US layout";
+    }
+    return stroke_report(ascii_keymap[index]);
+}
+
+/* Names usable in a {chord} of a constant key string, besides single characters */
+constexpr struct {
+    std::string_view name;
+    uint8_t modifier;
+    uint8_t usage;
+} constant_key_names[] = {
+    { "ctrl",  MOD_LEFTCTRL, 0 },  { "shift", MOD_LEFTSHIFT, 0 }, { "alt", MOD_LEFTALT, 0 },
+    { "meta",  MOD_LEFTMETA, 0 },  { "altgr", MOD_RIGHTALT, 0 },
+    { "enter", 0, 0x28 }, { "esc", 0, 0x29 },  { "backspace", 0, 0x2A }, { "tab", 0, 0x2B },
+    { "space", 0, 0x2C }, { "f1", 0, 0x3A },   { "f2", 0, 0x3B },   { "f3", 0, 0x3C },   { "f4", 0, 0x3D },
+    { "f5", 0, 0x3E },    { "f6", 0, 0x3F },   { "f7", 0, 0x40 },   { "f8", 0, 0x41 },   { "f9", 0, 0x42 },
+    { "f10", 0, 0x43 },   { "f11", 0, 0x44 },  { "f12", 0, 0x45 },  { "ins", 0, 0x49 },  { "home", 0, 0x4A },
+    { "pgup", 0, 0x4B },  { "del", 0, 0x4C },  { "end", 0, 0x4D },  { "pgdn", 0, 0x4E }, { "right", 0, 0x4F },
+    { "left", 0, 0x50 },  { "down", 0, 0x51 }, { "up", 0, 0x52 },
+};
+
+/* Report of a chord like "ctrl+alt+del": modifier and key names or characters joined by '+' */
+constexpr KeyReport constant_chord_report(std::string_view chord) {
+    KeyReport report;
+    size_t keys = 0;
+
+    while (!chord.empty()) {
+        /* A '+' right at the start is the key itself */
+        size_t plus = 1;
+        while (plus < chord.size() && chord[plus] != '+') {
+            plus++;
+        }
+        std::string_view name = chord.substr(0, plus);
+        chord = chord.substr(std::min(plus + 1, chord.size()));
+
+        KeyStroke stroke = { 0, 0 };
+        for (const auto &key : constant_key_names) {
+            if (key.name == name) {
+                stroke = { key.usage, key.modifier };
+            }
+        }
+        if (stroke.usage == 0 && stroke.modifier == 0) {
+            if (name.size() != 1) {
+                throw "unknown key name in {chord}";
+            }
+            KeyReport key = constant_key_report(name[0]);
+            stroke = { key.keys[0], key.modifier };
+        }
+
+        report.modifier |= stroke.modifier;
+        if (stroke.usage != 0) {
+            if (keys == report.keys.size()) {
+                throw "more than 6 keys in {chord}";
+            }
+            report.keys[keys++] = stroke.usage;
+        }
+    }
+    return report;
+}
+
+/*
+ * Report of the character or {chord} at text[pos], pos moves past it.
+ * "{{" types a '{'.
+ */
+constexpr KeyReport constant_token_report(std::string_view text, size_t &pos) {
+    if (text[pos] == '{' && pos + 1 < text.size() && text[pos + 1] != '{') {
+        size_t close = pos + 1;
+        while (close < text.size() && text[close] != '}') {
+            close++;
+        }
+        if (close == text.size()) {
+            throw "{chord} without a closing brace";
+        }
+        KeyReport report = constant_chord_report(text.substr(pos + 1, close - pos - 1));
+        pos = close + 1;
+        return report;
+    }
+    if (text[pos] == '{') {
+        pos++;
+    }
+    return constant_key_report(text[pos++]);
+}
+
+/*
+ * translate_text() for a string known at compile time: US layout, one
+ * key or {chord} per report, same release elision. emit(report) gets
+ * every report.
+ */
+template<typename Emit>
+constexpr void translate_constant(std::string_view text, Emit emit) {
+    KeyStateTracker tracker;
+
+    size_t pos = 0;
+    KeyReport next;
+    bool has_next = pos < text.size();
+    if (has_next) {
+        next = constant_token_report(text, pos);
+    }
+    while (has_next) {
+        KeyReport report = next;
+        has_next = pos < text.size();
+        if (has_next) {
+            next = constant_token_report(text, pos);
+        }
+        const KeyReport *next_report = has_next ? &next : nullptr;
+
+        if (!keys_pressed_in_order(tracker.state(), report)) {
+            emit(tracker.release(&report));
+        }
+        emit(tracker.press(report));
+        if (tracker.needs_release(next_report)) {
+            emit(tracker.release(next_report));
+        }
+    }
+}
+
+/* String literal usable as a template argument */
+template<size_t N>
+struct KeyString {
+    char chars[N];
+
+    constexpr KeyString(const char (&str)[N]) {
+        for (size_t i = 0; i < N; i++) {
+            chars[i] = str[i];
+        }
+    }
+
+    constexpr std::string_view view() const {
+        return std::string_view(chars, N - 1);
+    }
+};
+
+template<KeyString S>
+consteval size_t constant_report_count() {
+    size_t count = 0;
+    translate_constant(S.view(), [&count](const KeyReport &) { count++; });
+    return count;
+}
+
+/*
+ * "text"_keys is the std::array of reports typing text, built at compile
+ * time. "{ctrl+alt+del}" presses keys together, see constant_key_names.
+ * Characters without a key on the US layout fail to compile.
+ *
+ *   constexpr auto banner = "login: admin\n"_keys;
+ *   send_key_reports(conn, banner);
+ */
+template<KeyString S>
+consteval std::array<PackedKeyReport, constant_report_count<S>()> operator""_keys() {
+    std::array<PackedKeyReport, constant_report_count<S>()> reports{};
+    size_t count = 0;
+    translate_constant(S.view(), [&](const KeyReport &report) { reports[count++] = packed_key_report(report); });
+    return reports;
+}
+
+static_assert("Hi"_keys.size() == 3, "_keys: Shift+h replaced by i, then released");
+static_assert("aa"_keys.size() == 4, "_keys: a repeated key is released in between");
+static_assert("A"_keys[0] == PackedKeyReport{ 0xA1, 0x01, MOD_LEFTSHIFT, 0x00, 0x04, 0, 0, 0, 0, 0 }, "_keys: 'A'");
+static_assert("{ctrl+shift+t}"_keys[0] == PackedKeyReport{ 0xA1, 0x01, MOD_LEFTCTRL | MOD_LEFTSHIFT, 0x00, 0x17, 0, 0, 0, 0, 0 } &&
+              "{ctrl+shift+t}"_keys.size() == 2, "_keys: {chord}");
+static_assert("{{"_keys[0][2] == MOD_LEFTSHIFT && "{{"_keys[0][4] == 0x2F, "_keys: {{ types a brace");
+
+/* Secure attention sequence, for Windows logon and lock screens */
+constexpr auto ctrl_alt_del = "{ctrl+alt+del}"_keys;
+
+/*
+ * Write reports built by _keys, paced like send_string_input(): a press
+ * is held key_down_time, key_delay follows a release and a press whose
+ * release was elided.
+ */
+bool send_key_reports(const BluetoothConnection &conn, std::span<const PackedKeyReport> reports,
+                      const TypingOptions &options = typing_options, ReportScheduler *scheduler = nullptr) {
+    ReportScheduler local_scheduler;
+    if (!scheduler) {
+        scheduler = &local_scheduler;
+    }
+
+    /* Anything held, a chord may be modifiers alone */
+    auto held = [](const PackedKeyReport &report) {
+        return report[2] != 0 || report[4] != 0;
+    };
+    for (size_t i = 0; i < reports.size(); i++) {
+        if (!send_packed_key_report(conn, reports[i])) {
+            return false;
+        }
+
+        bool pressed = held(reports[i]);
+        bool released_next = i + 1 == reports.size() || !held(reports[i + 1]);
+        if (!pressed) {
+            scheduler->wait_next(options.key_delay);
+        } else {
+            scheduler->wait_next(released_next ? options.key_down_time : options.key_down_time + options.key_delay);
+        }
+    }
+    return true;
+}
+
+#define REPORT_STREAM_MAGIC "HIDR"
+#define REPORT_STREAM_VERSION 1
+
+/*
+ * Precompiled report stream, little endian, built by --compile-text:
+ *
+ *   ReportStreamHeader
+ *   ReportRecord records[record_count]
+ *
+ * Each record holds the exact bytes send_keys() writes to the interrupt
+ * channel and the delay to wait after the previous record, so replaying
+ * it needs no translation at all. checksum is the CRC-32 of the records.
+ */
+struct ReportStreamHeader {
+    char magic[4];
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t record_count;
+    uint32_t checksum;
+    uint64_t duration_us;       /* Sum of all record delays */
+};
+
+struct ReportRecord {
+    uint32_t delay_us;          /* Wait after the previous record before sending this one */
+    uint8_t report[KeyboardInputReport::size];
+    uint8_t reserved[2];
+};
+
+static_assert(sizeof(ReportStreamHeader) == 24, "ReportStreamHeader must match the file format");
+static_assert(sizeof(ReportRecord) == 16, "ReportRecord must match the file format");
+
+constexpr std::array<uint32_t, 256> make_crc32_table() {
+    std::array<uint32_t, 256> table{};
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+        }
+        table[i] = crc;
+    }
+    return table;
+}
+
+constexpr std::array<uint32_t, 256> crc32_table = make_crc32_table();
+
+uint32_t crc32(const void *data, size_t len, uint32_t crc = 0) {
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc = crc32_table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+/* Keyboard input report bytes as written by send_keys() */
+void pack_key_report(const KeyReport &report, uint8_t *out) {
+    PackedKeyReport packed = packed_key_report(report);
+    memcpy(out, packed.data(), packed.size());
+}
+
+/* Compile a text file into a report stream using the typing options from the command line */
+bool compile_report_stream(const char *src_path, const char *dst_path, const TypingOptions &options) {
+    std::ifstream src(src_path, std::ios::binary);
+    if (!src.is_open()) {
+        std::cerr << "Cannot open text file: " << src_path << std::endl;
+        return false;
+    }
+    std::stringstream buffer;
+    buffer << src.rdbuf();
+    const std::string text = buffer.str();
+
+    std::vector<ReportRecord> records;
+    float pending_delay = 0;
+
+    translate_text(text, options, nullptr, [&](const KeyReport &report, float delay, size_t) {
+        ReportRecord record = {};
+        record.delay_us = static_cast<uint32_t>(pending_delay * 1e6f + 0.5f);
+        pack_key_report(report, record.report);
+        records.push_back(record);
+        pending_delay = delay;
+        return true;
+    });
+
+    ReportStreamHeader header = {};
+    memcpy(header.magic, REPORT_STREAM_MAGIC, 4);
+    header.version = REPORT_STREAM_VERSION;
+    header.record_size = sizeof(ReportRecord);
+    header.record_count = records.size();
+    header.checksum = crc32(records.data(), records.size() * sizeof(ReportRecord));
+    for (const ReportRecord &record : records) {
+        header.duration_us += record.delay_us;
+    }
+
+    std::ofstream dst(dst_path, std::ios::binary | std::ios::trunc);
+    dst.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    dst.write(reinterpret_cast<const char *>(records.data()), records.size() * sizeof(ReportRecord));
+    if (!dst) {
+        std::cerr << "Failed to write report stream: " << dst_path << std::endl;
+        return false;
+    }
+
+    char checksum[9];
+    snprintf(checksum, sizeof(checksum), "%08x", header.checksum);
+    std::cout << src_path << ": " << text.size() << " bytes -> " << records.size() << " reports, "
+              << header.duration_us / 1000 << " ms, crc32 " << checksum << " -> " << dst_path << std::endl;
+    return true;
+}
+
+/*
+ * A report stream file mapped read-only into memory, validated
+ * (header, size and checksum) once when it is opened.
+ */
+class ReportStream {
+public:
+    static std::unique_ptr<ReportStream> open(const std::string &path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            std::cerr << "Cannot open report stream " << path << ": " << strerror(errno) << std::endl;
+            return nullptr;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(ReportStreamHeader)) {
+            std::cerr << "Report stream " << path << " is too short" << std::endl;
+            close(fd);
+            return nullptr;
+        }
+
+        size_t size = st.st_size;
+        void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+            std::cerr << "Cannot map report stream " << path << ": " << strerror(errno) << std::endl;
+            return nullptr;
+        }
+
+        /* Records are read front to back exactly once */
+        madvise(map, size, MADV_SEQUENTIAL);
+
+        std::unique_ptr<ReportStream> stream(new ReportStream(map, size));
+        if (!stream->validate(path)) {
+            return nullptr;
+        }
+        return stream;
+    }
+
+    ~ReportStream() {
+        munmap(map_, map_size_);
+    }
+
+    ReportStream(const ReportStream &) = delete;
+    ReportStream &operator=(const ReportStream &) = delete;
+
+    const ReportStreamHeader &header() const {
+        return header_;
+    }
+
+    const ReportRecord *records() const {
+        return records_;
+    }
+
+private:
+    ReportStream(void *map, size_t size) : map_(map), map_size_(size) {
+    }
+
+    bool validate(const std::string &path) {
+        const uint8_t *base = static_cast<const uint8_t *>(map_);
+        memcpy(&header_, base, sizeof(header_));
+
+        if (memcmp(header_.magic, REPORT_STREAM_MAGIC, 4) != 0 || header_.version != REPORT_STREAM_VERSION ||
+            header_.record_size != sizeof(ReportRecord)) {
+            std::cerr << "Report stream " << path << " has a bad header" << std::endl;
+            return false;
+        }
+
+        uint64_t records_size = uint64_t(header_.record_count) * sizeof(ReportRecord);
+        if (sizeof(ReportStreamHeader) + records_size != map_size_) {
+            std::cerr << "Report stream " << path << " size doesn't match its header" << std::endl;
+            return false;
+        }
+
+        records_ = reinterpret_cast<const ReportRecord *>(base + sizeof(ReportStreamHeader));
+        if (crc32(records_, records_size) != header_.checksum) {
+            std::cerr << "Report stream " << path << " checksum mismatch" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    void *map_;
+    size_t map_size_;
+    ReportStreamHeader header_;
+    const ReportRecord *records_ = nullptr;
+};
+
+/*
+ * Write a report stream to the interrupt channel straight from the
+ * mapping, starting at record start, each record on its scheduled
+ * deadline. Stops at the first failed write, with link_lost set.
+ * Returns the index of the first record not sent.
+ */
+size_t replay_report_stream(const BluetoothConnection &conn, const ReportStream &stream,
+                            const std::atomic<bool> *cancel = nullptr, ReportScheduler *scheduler = nullptr,
+                            size_t start = 0, bool *link_lost = nullptr) {
+    ReportScheduler local_scheduler;
+    if (!scheduler) {
+        scheduler = &local_scheduler;
+    }
+
+    const ReportRecord *records = stream.records();
+    uint32_t count = stream.header().record_count;
+    size_t sent = start;
+
+    for (; sent < count; sent++) {
+        if (cancel && cancel->load()) {
+            break;
+        }
+        if (sent > start) {
+            scheduler->wait_next(records[sent].delay_us / 1e6f);
+        }
+        PackedKeyReport packed;
+        memcpy(packed.data(), records[sent].report, packed.size());
+        if (!send_packed_key_report(conn, packed)) {
+            if (link_lost) {
+                *link_lost = true;
+            }
+            return sent;
+        }
+    }
+
+    /* Cancelled in the middle, make sure no key stays down on the host */
+    if (sent < count) {
+        send_keys(conn, 0, { 0, 0, 0, 0, 0, 0 });
+    }
+    return sent;
+}
+
+#define PASTE_CHUNK_SIZE 4096
+#define PASTE_QUEUE_CHUNKS 2
+
+/* Length of the longest prefix of text not ending in a cut-off UTF-8 sequence */
+size_t utf8_complete_prefix(const std::string &text) {
+    size_t len = text.size();
+    for (size_t back = 1; back <= 3 && back <= len; back++) {
+        uint8_t byte = static_cast<uint8_t>(text[len - back]);
+        if ((byte & 0xC0) == 0x80) {
+            continue;
+        }
+        size_t need = (byte & 0xE0) == 0xC0 ? 2 : (byte & 0xF0) == 0xE0 ? 3 : (byte & 0xF8) == 0xF0 ? 4 : 1;
+        return need > back ? len - back : len;
+    }
+    return len;
+}
+
+/*
+ * A file or FIFO being pasted, opened when the job is queued.
+ * When a paste stops early the source keeps its read position plus the
+ * bytes already read but not typed, so the job can continue from the
+ * first untyped byte, even on a pipe.
+ */
+struct PasteSource {
+    std::string path;
+    int fd = -1;
+    uint64_t size = 0;      /* 0 when unknown (pipes) */
+    uint64_t offset = 0;    /* Source bytes typed before pending */
+    std::string pending;    /* Read but not yet typed, typed before reading more */
+
+    ~PasteSource() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    static std::shared_ptr<PasteSource> open(const std::string &path) {
+        /* Non-blocking so a FIFO without a writer yet doesn't hang the caller */
+        int fd = ::open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0) {
+            std::cerr << "Cannot open " << path << ": " << strerror(errno) << std::endl;
+            return nullptr;
+        }
+
+        auto source = std::make_shared<PasteSource>();
+        source->path = path;
+        source->fd = fd;
+
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            source->size = st.st_size;
+        }
+        return source;
+    }
+};
+
+struct TimedReport {
+    KeyReport report;
+    float delay;            /* Seconds to wait after sending it */
+    uint32_t typed;         /* Chunk bytes fully typed once it is sent */
+};
+
+/* A piece of the paste and its reports */
+struct PasteChunk {
+    uint64_t offset;        /* Source offset of text[0] */
+    std::string text;
+    std::vector<TimedReport> reports;
+};
+
+struct PasteProgress {
+    uint64_t typed;         /* Source bytes typed so far */
+    uint64_t total;         /* Source size, 0 when unknown */
+    uint64_t chars;         /* Characters typed so far */
+    double chars_per_sec;   /* Since the previous progress report */
+};
+
+using PasteProgressCallback = std::function<void(const PasteProgress &)>;
+
+/*
+ * Reads a paste source in PASTE_CHUNK_SIZE pieces on its own thread and
+ * translates each piece while the previous one is being sent. At most
+ * PASTE_QUEUE_CHUNKS translated chunks wait in between, so memory use is
+ * the same for a 1 KiB file and an endless pipe.
+ */
+class PastePipeline {
+public:
+    PastePipeline(std::shared_ptr<PasteSource> source, const TypingOptions &options)
+        : source_(std::move(source)), options_(options), reader_(&PastePipeline::read_loop, this) {
+    }
+
+    ~PastePipeline() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        changed_.notify_all();
+        if (reader_.joinable()) {
+            reader_.join();
+        }
+    }
+
+    PastePipeline(const PastePipeline &) = delete;
+    PastePipeline &operator=(const PastePipeline &) = delete;
+
+    /* Stop the reader, returning every byte it read that pop() didn't hand out */
+    std::string take_unsent() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        changed_.notify_all();
+        if (reader_.joinable()) {
+            reader_.join();
+        }
+
+        std::string unsent;
+        for (const PasteChunk &chunk : chunks_) {
+            unsent += chunk.text;
+        }
+        chunks_.clear();
+        return unsent + carry_;
+    }
+
+    /* Next translated chunk, false once the source is exhausted */
+    bool pop(PasteChunk &chunk) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        changed_.wait(lock, [this] { return !chunks_.empty() || finished_; });
+        if (chunks_.empty()) {
+            return false;
+        }
+
+        chunk = std::move(chunks_.front());
+        chunks_.pop_front();
+        changed_.notify_all();
+        return true;
+    }
+
+private:
+    void read_loop() {
+        /* A resumed paste first types what was read before it stopped */
+        carry_ = std::move(source_->pending);
+        source_->pending.clear();
+        bool resumed = !carry_.empty();
+        uint64_t offset = source_->offset;
+        char buf[PASTE_CHUNK_SIZE];
+
+        while (true) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (stopping_) {
+                    break;
+                }
+            }
+
+            ssize_t len;
+            if (resumed) {
+                resumed = false;
+                len = 0;
+            } else {
+                /* Poll with a timeout so a stalled pipe doesn't keep the pipeline from stopping */
+                struct pollfd pfd = { source_->fd, POLLIN, 0 };
+                int ready = poll(&pfd, 1, 200);
+                if (ready == 0 || (ready < 0 && errno == EINTR)) {
+                    continue;
+                }
+
+                len = ready > 0 ? read(source_->fd, buf, sizeof(buf)) : -1;
+                if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+                    continue;
+                }
+                if (len < 0) {
+                    std::cerr << "Read error on " << source_->path << ": " << strerror(errno) << std::endl;
+                }
+                if (len == 0) {
+                    len = -1;   /* End of input, flush whatever is left in carry */
+                }
+            }
+
+            PasteChunk chunk;
+            chunk.offset = offset;
+            chunk.text = std::move(carry_);
+            carry_.clear();
+            if (len > 0) {
+                chunk.text.append(buf, len);
+            }
+            if (len >= 0) {
+                size_t complete = utf8_complete_prefix(chunk.text);
+                carry_ = chunk.text.substr(complete);
+                chunk.text.resize(complete);
+            }
+
+            translate_text(chunk.text, options_, nullptr, [&chunk](const KeyReport &report, float delay, size_t typed) {
+                chunk.reports.push_back({ report, delay, static_cast<uint32_t>(typed) });
+                return true;
+            });
+            offset += chunk.text.size();
+
+            if (!chunk.text.empty()) {
+                std::unique_lock<std::mutex> lock(mutex_);
+                changed_.wait(lock, [this] { return chunks_.size() < PASTE_QUEUE_CHUNKS || stopping_; });
+                if (stopping_) {
+                    /* Keep the bytes for take_unsent() */
+                    carry_ = chunk.text + carry_;
+                    break;
+                }
+                chunks_.push_back(std::move(chunk));
+                changed_.notify_all();
+            }
+
+            /* End of file, or the last writer of a FIFO went away */
+            if (len < 0) {
+                break;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        finished_ = true;
+        changed_.notify_all();
+    }
+
+    std::shared_ptr<PasteSource> source_;
+    TypingOptions options_;
+
+    std::string carry_;     /* Read but not yet in a chunk (a cut UTF-8 sequence, resumed bytes) */
+
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::deque<PasteChunk> chunks_;
+    bool finished_ = false;
+    bool stopping_ = false;
+
+    std::thread reader_;    /* Declared last, started once every member above is ready */
+};
+
+/*
+ * Paste a file or FIFO on the host through a PastePipeline, reporting
+ * progress about once a second. Stops at the first failed write, with
+ * link_lost set. A paste that stops early leaves source ready to continue
+ * after the last report the host received.
+ * Returns the source offset typed up to.
+ */
+uint64_t paste_file(const BluetoothConnection &conn, std::shared_ptr<PasteSource> source, const TypingOptions &options,
+                    const std::atomic<bool> *cancel = nullptr, ReportScheduler *scheduler = nullptr,
+                    const PasteProgressCallback &on_progress = nullptr, bool *link_lost = nullptr,
+                    TypingPacer *pacer = nullptr) {
+    ReportScheduler local_scheduler;
+    if (!scheduler) {
+        scheduler = &local_scheduler;
+    }
+
+    /* Chunks are translated ahead, for the Caps Lock state the host has now */
+    TypingOptions host_options = options;
+    host_options.caps_lock = host_caps_lock();
+
+    PastePipeline pipeline(source, host_options);
+    PasteChunk chunk;
+    uint64_t typed = source->offset;
+    uint64_t chars = 0;
+    uint64_t last_chars = 0;
+    int64_t last_progress_ns = monotonic_now_ns();
+    bool key_down = false;
+    bool caps_switched = false;    /* Inside a chunk typed with Caps Lock switched */
+    bool stopped = false;
+
+    while (!stopped && pipeline.pop(chunk)) {
+        uint32_t chunk_typed = 0;
+
+        for (const TimedReport &timed : chunk.reports) {
+            if (cancel && cancel->load()) {
+                stopped = true;
+                break;
+            }
+
+            if (pacer) {
+                pacer->before_send(conn);
+            }
+            if (!send_key_report(conn, timed.report, options.keyboard_mode)) {
+                if (link_lost) {
+                    *link_lost = true;
+                }
+                stopped = true;
+                break;
+            }
+            key_down = timed.report.modifier != 0 || timed.report.keys[0] != 0;
+            if (timed.report.keys[0] == KEY_CAPS_LOCK) {
+                caps_switched = !caps_switched;
+            }
+            scheduler->wait_next(pacer ? pacer->after_send() : timed.delay);
+
+            /* Count characters by their UTF-8 lead bytes */
+            for (uint32_t i = chunk_typed; i < timed.typed; i++) {
+                chars += (static_cast<uint8_t>(chunk.text[i]) & 0xC0) != 0x80;
+            }
+            chunk_typed = timed.typed;
+            typed = chunk.offset + chunk_typed;
+
+            int64_t now = monotonic_now_ns();
+            if (on_progress && now - last_progress_ns >= 1000000000LL) {
+                double cps = (chars - last_chars) * 1e9 / (now - last_progress_ns);
+                on_progress({ typed, source->size, chars, cps });
+                last_chars = chars;
+                last_progress_ns = now;
+            }
+        }
+
+        if (stopped) {
+            /* Remember everything read but not typed, for a resume */
+            source->offset = typed;
+            source->pending = chunk.text.substr(chunk_typed) + pipeline.take_unsent();
+            break;
+        }
+        typed = chunk.offset + chunk.text.size();
+    }
+
+    /* Cancelled in the middle of a run, don't leave keys held on the host */
+    if (key_down && !(link_lost && *link_lost)) {
+        send_key_report(conn, KeyReport(), options.keyboard_mode);
+    }
+
+    /* Nor with Caps Lock switched */
+    if (caps_switched && !(link_lost && *link_lost)) {
+        KeyReport caps_key;
+        caps_key.keys[0] = KEY_CAPS_LOCK;
+        send_key_report(conn, caps_key, options.keyboard_mode);
+        scheduler->wait_next(options.key_down_time);
+        send_key_report(conn, KeyReport(), options.keyboard_mode);
+    }
+    return typed;
+}
+
+#define KEY_SCROLL_LOCK 0x47
+#define RTT_BUCKETS 24              /* Power of two microsecond buckets, the last one open ended */
+#define RTT_PROBE_TAPS 2            /* Toggle Scroll Lock, then toggle it back */
+#define RTT_PROBE_TIMEOUT_MS 1000
+#define RTT_PROBE_MAX_LOST 3        /* Unanswered taps in a row before periodic probes stop */
+
+/*
+ * Round trip times to one host: from writing a Scroll Lock press to the
+ * arrival of the LED output report the host sends back. Bucket i counts
+ * samples from 2^i up to 2^(i+1) microseconds.
+ */
+struct RttHistogram {
+    std::array<uint64_t, RTT_BUCKETS> buckets{};
+    uint64_t samples = 0;
+    uint64_t lost = 0;
+    unsigned lost_in_row = 0;
+    int64_t min_ns = 0;
+    int64_t max_ns = 0;
+    int64_t total_ns = 0;
+    int64_t last_ns = 0;
+
+    void add(int64_t ns) {
+        int64_t us = std::max<int64_t>(ns / 1000, 1);
+        size_t bucket = 0;
+        while (bucket + 1 < buckets.size() && us >= (int64_t(2) << bucket)) {
+            bucket++;
+        }
+        buckets[bucket]++;
+        min_ns = samples == 0 ? ns : std::min(min_ns, ns);
+        max_ns = std::max(max_ns, ns);
+        total_ns += ns;
+        last_ns = ns;
+        samples++;
+        lost_in_row = 0;
+    }
+
+    void print(std::ostream &out) const {
+        out << samples << " samples, " << lost << " lost";
+        if (samples > 0) {
+            out << ", min " << min_ns / 1000 << " us, avg " << total_ns / int64_t(samples) / 1000
+                << " us, max " << max_ns / 1000 << " us";
+        }
+        out << std::endl;
+
+        uint64_t most = *std::max_element(buckets.begin(), buckets.end());
+        for (size_t i = 0; i < buckets.size(); i++) {
+            if (buckets[i] == 0) {
+                continue;
+            }
+            out << "  " << std::setw(8) << (int64_t(1) << i) << " us | "
+                << std::string(std::max<uint64_t>(buckets[i] * 40 / most, 1), '#') << " " << buckets[i] << std::endl;
+        }
+    }
+};
+
+/* Round trip times per remote bdaddr, kept across connections */
+std::mutex host_rtt_mutex;
+std::map<std::string, RttHistogram> host_rtt;
+
+/*
+ * Seconds between latency probes while typing is idle, 0 = only /probe;
+ * set from the command line. Off by default: every probe is a key press
+ * to the host, which restarts its screensaver and sleep timers.
+ */
+unsigned rtt_probe_interval = 0;
+
+/* Whether periodic probes still get answers from this host */
+bool rtt_probe_answered(const std::string &addr) {
+    std::lock_guard<std::mutex> lock(host_rtt_mutex);
+    auto rtt = host_rtt.find(addr);
+    return rtt == host_rtt.end() || rtt->second.lost_in_row < RTT_PROBE_MAX_LOST;
+}
+
+/*
+ * Measure the host round trip with Scroll Lock: each tap makes the host
+ * flip its Scroll Lock LED and send an LED output report, timed from the
+ * write of the press to the report's arrival. The key is tapped twice so
+ * the host ends with the LED it had, even when it does not echo the first
+ * tap. Must run on the typing thread so the taps don't land inside typed
+ * text. Returns the taps answered, with link_lost set when a write failed.
+ */
+size_t probe_latency(const BluetoothConnection &conn, bool *link_lost) {
+    std::string addr = remote_address(conn);
+    size_t answered = 0;
+
+    for (int tap = 0; tap < RTT_PROBE_TAPS; tap++) {
+        uint64_t reports;
+        {
+            std::lock_guard<std::mutex> lock(host_state_mutex);
+            reports = host_state.led_reports;
+        }
+
+        int64_t sent_ns = monotonic_now_ns();
+        if (!send_keys(conn, 0, { KEY_SCROLL_LOCK, 0, 0, 0, 0, 0 }) || !send_keys(conn, 0, { 0, 0, 0, 0, 0, 0 })) {
+            *link_lost = true;
+            break;
+        }
+
+        int64_t echo_ns = 0;
+        {
+            std::unique_lock<std::mutex> lock(host_state_mutex);
+            if (host_leds_changed.wait_for(lock, std::chrono::milliseconds(RTT_PROBE_TIMEOUT_MS),
+                                           [reports] { return host_state.led_reports != reports; })) {
+                echo_ns = host_state.led_report_ns;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(host_rtt_mutex);
+        RttHistogram &rtt = host_rtt[addr];
+        if (echo_ns != 0) {
+            rtt.add(echo_ns - sent_ns);
+            answered++;
+        } else {
+            rtt.lost++;
+            rtt.lost_in_row++;
+        }
+    }
+    return answered;
+}
+
+enum class TypingStatus {
+    Completed,
+    Cancelled,
+    Interrupted,    /* Connection lost, the job continues on the next connection */
+};
+
+struct TypingResult {
+    uint64_t job_id;
+    TypingStatus status;
+    size_t typed;           /* Bytes of text (records of a replay) sent before the job ended */
+    size_t total;
+    int64_t elapsed_ns;
+    SchedulerStats timing;  /* Per-report wake-up lateness of the job */
+};
+
+using TypingCallback = std::function<void(const TypingResult &)>;
+
+struct TypingJob {
+    uint64_t id;
+    std::string text;
+    std::shared_ptr<const ReportStream> stream;     /* Replay this instead of typing text when set */
+    std::shared_ptr<PasteSource> paste;             /* Stream this file instead of typing text when set */
+    TypingOptions options;
+    TypingCallback on_complete;
+    PasteProgressCallback on_progress;
+    size_t resume_offset = 0;   /* Bytes of text (records of a replay) typed before an interruption */
+    bool probe = false;         /* Run probe_latency() instead of typing */
+    bool chord = false;         /* Press chord_keys at once with chord_modifier held instead of typing */
+    uint8_t chord_modifier = 0;
+    std::vector<uint8_t> chord_keys;
+    std::span<const PackedKeyReport> reports;   /* Constant reports built by _keys to write instead of typing */
+
+    size_t size() const {
+        if (probe) {
+            return RTT_PROBE_TAPS;
+        }
+        if (chord) {
+            return 1;
+        }
+        if (!reports.empty()) {
+            return reports.size();
+        }
+        if (stream) {
+            return stream->header().record_count;
+        }
+        return paste ? paste->size : resume_offset + text.size();
+    }
+
+    /* Probes, chords and constant reports are sent whole or not at all, they don't carry over to the next connection */
+    bool resumable() const {
+        return !probe && !chord && reports.empty();
+    }
+};
+
+/* Ids stay unique across connections, a resumed job keeps its id */
+static std::atomic<uint64_t> next_typing_job_id{1};
+
+/*
+ * Background sender for keyboard text.
+ *
+ * send_string_input() sleeps between every report, so typing a long
+ * paste inline blocks the input loop for minutes. TypingSender owns a
+ * worker thread that types queued jobs one after another on the
+ * interrupt channel while the caller keeps polling stdin and the sockets.
+ *
+ * The queue is bounded: enqueue() refuses new jobs once max_jobs are
+ * waiting. cancel() drops every queued job and stops the running one at
+ * the next character, flush() blocks until everything queued is typed.
+ *
+ * A failed write means the host went away: the running job is kept with
+ * the offset of the last report written and the queue is paused. On
+ * disconnect suspend() hands back the unfinished jobs, resume() queues
+ * them on the sender of the next connection from that host.
+ *
+ * A host that is connected but stops reading makes a write time out
+ * instead. The job goes back to the head of the queue and the worker
+ * waits for the send window to drain, then types on from where it was.
+ */
+class TypingSender {
+public:
+    explicit TypingSender(const BluetoothConnection &conn, size_t max_jobs = 32, float typing_rate = TYPING_RATE_START)
+        : conn_(conn), max_jobs_(max_jobs), pacer_(typing_rate), worker_(&TypingSender::run, this) {
+    }
+
+    ~TypingSender() {
+        stop();
+    }
+
+    TypingSender(const TypingSender &) = delete;
+    TypingSender &operator=(const TypingSender &) = delete;
+
+    /* Returns the job id, 0 when the queue is full or the sender stopped */
+    uint64_t enqueue(const std::string &text, TypingCallback on_complete = nullptr,
+                     const TypingOptions &options = typing_options) {
+        TypingJob job;
+        job.text = text;
+        job.options = options;
+        job.on_complete = std::move(on_complete);
+        return push(std::move(job));
+    }
+
+    /* Queue a precompiled report stream, replayed in order with the text jobs */
+    uint64_t enqueue_replay(std::shared_ptr<const ReportStream> stream, TypingCallback on_complete = nullptr) {
+        TypingJob job;
+        job.stream = std::move(stream);
+        job.options = typing_options;
+        job.on_complete = std::move(on_complete);
+        return push(std::move(job));
+    }
+
+    /* Queue a file or FIFO to be typed as it is read, see paste_file() */
+    uint64_t enqueue_paste(std::shared_ptr<PasteSource> source, TypingCallback on_complete = nullptr,
+                           PasteProgressCallback on_progress = nullptr, const TypingOptions &options = typing_options) {
+        TypingJob job;
+        job.paste = std::move(source);
+        job.options = options;
+        job.on_complete = std::move(on_complete);
+        job.on_progress = std::move(on_progress);
+        return push(std::move(job));
+    }
+
+    /* Queue a latency probe, see probe_latency(), the result counts the taps answered */
+    uint64_t enqueue_probe(TypingCallback on_complete = nullptr) {
+        TypingJob job;
+        job.probe = true;
+        job.on_complete = std::move(on_complete);
+        return push(std::move(job));
+    }
+
+    /* Queue reports built by _keys, they must outlive the sender */
+    uint64_t enqueue_keys(std::span<const PackedKeyReport> reports, TypingCallback on_complete = nullptr,
+                          const TypingOptions &options = typing_options) {
+        TypingJob job;
+        job.reports = reports;
+        job.options = options;
+        job.on_complete = std::move(on_complete);
+        return push(std::move(job));
+    }
+
+    /* Queue a chord, see send_chord(), pressed in order with the text around it */
+    uint64_t enqueue_chord(uint8_t modifier, std::vector<uint8_t> usages, TypingCallback on_complete = nullptr,
+                           const TypingOptions &options = typing_options) {
+        TypingJob job;
+        job.chord = true;
+        job.chord_modifier = modifier;
+        job.chord_keys = std::move(usages);
+        job.options = options;
+        job.on_complete = std::move(on_complete);
+        return push(std::move(job));
+    }
+
+    /* Block until everything queued is typed, or the link is lost or the sender stopped */
+    void flush() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        idle_.wait(lock, [this] { return (jobs_.empty() && !busy_) || link_lost_ || stopping_; });
+    }
+
+    void cancel() {
+        std::deque<TypingJob> dropped;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            dropped.swap(jobs_);
+            queued_bytes_ = 0;
+            if (busy_) {
+                cancel_current_ = true;
+            }
+        }
+
+        for (const TypingJob &job : dropped) {
+            if (job.on_complete) {
+                job.on_complete({ job.id, TypingStatus::Cancelled, 0, job.size(), 0, SchedulerStats() });
+            }
+        }
+        idle_.notify_all();
+    }
+
+    /*
+     * Stop the running job where it is and return it, followed by every
+     * queued job, ready for resume(). The sender is left idle.
+     */
+    std::vector<TypingJob> suspend() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        suspending_ = true;
+        if (busy_) {
+            cancel_current_ = true;
+        }
+        idle_.wait(lock, [this] { return !busy_; });
+
+        std::vector<TypingJob> unfinished = std::move(interrupted_);
+        interrupted_.clear();
+        for (TypingJob &job : jobs_) {
+            if (job.resumable()) {
+                unfinished.push_back(std::move(job));
+            }
+        }
+        jobs_.clear();
+        queued_bytes_ = 0;
+        return unfinished;
+    }
+
+    /* Queue jobs handed out by suspend() ahead of anything new, ignoring max_jobs */
+    void resume(std::vector<TypingJob> jobs) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopping_) {
+            return;
+        }
+        for (TypingJob &job : jobs) {
+            queued_bytes_ += job.text.size();
+            jobs_.push_back(std::move(job));
+        }
+        job_ready_.notify_one();
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (stopping_) {
+                return;
+            }
+        }
+        cancel();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        job_ready_.notify_all();
+        idle_.notify_all();
+
+        if (worker_.joinable()) {
+            worker_.join();
+        }
+    }
+
+    /* Jobs waiting plus the one being typed */
+    size_t queue_depth() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return jobs_.size() + (busy_ ? 1 : 0);
+    }
+
+    size_t queued_bytes() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return queued_bytes_;
+    }
+
+    /* Rate the link sustains as learned so far, shared by every job of this connection */
+    const TypingPacer &pacer() const {
+        return pacer_;
+    }
+
+private:
+    uint64_t push(TypingJob job) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopping_ || jobs_.size() >= max_jobs_) {
+            return 0;
+        }
+
+        job.id = next_typing_job_id++;
+        queued_bytes_ += job.text.size();
+        jobs_.push_back(std::move(job));
+        job_ready_.notify_one();
+        return jobs_.back().id;
+    }
+
+    void run() {
+        while (true) {
+            TypingJob job;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                job_ready_.wait(lock, [this] { return (!jobs_.empty() && !link_lost_ && !suspending_) || stopping_; });
+                if (stopping_) {
+                    return;
+                }
+
+                job = std::move(jobs_.front());
+                jobs_.pop_front();
+                queued_bytes_ -= job.text.size();
+                busy_ = true;
+                cancel_current_ = false;
+            }
+
+            ReportScheduler scheduler;
+            size_t typed;
+            bool link_lost = false;
+            uint64_t timeouts = interrupt_stats.timeouts.load();
+            if (job.probe) {
+                typed = probe_latency(conn_, &link_lost);
+            } else if (!job.reports.empty()) {
+                typed = send_key_reports(conn_, job.reports, job.options, &scheduler) ? job.reports.size() : 0;
+                link_lost = typed == 0;
+            } else if (job.chord) {
+                /* The host may have switched to boot protocol since the chord was queued */
+                typed = 0;
+                if (fit_chord(job.chord_modifier, job.chord_keys, active_keyboard_mode(job.options.keyboard_mode))) {
+                    typed = send_chord(conn_, job.chord_modifier, job.chord_keys, job.options) ? 1 : 0;
+                    link_lost = typed == 0;
+                }
+            } else if (job.stream) {
+                typed = replay_report_stream(conn_, *job.stream, &cancel_current_, &scheduler, job.resume_offset, &link_lost);
+            } else if (job.paste) {
+                typed = paste_file(conn_, job.paste, job.options, &cancel_current_, &scheduler, job.on_progress, &link_lost,
+                                   job.options.adaptive_rate ? &pacer_ : nullptr);
+            } else {
+                typed = job.resume_offset + send_string_input(conn_, job.text, job.options, &cancel_current_, &scheduler, &link_lost,
+                                                              job.options.adaptive_rate ? &pacer_ : nullptr);
+            }
+
+            TypingResult result = { job.id, TypingStatus::Completed, typed, job.paste && job.size() == 0 ? typed : job.size(),
+                                    scheduler.elapsed_ns(), scheduler.stats() };
+            bool interrupted;
+            bool stalled;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                interrupted = link_lost || (cancel_current_ && suspending_);
+                stalled = link_lost && !cancel_current_ && !suspending_ && interrupt_stats.timeouts.load() != timeouts;
+            }
+            if (stalled && job.resumable()) {
+                std::cout << "[Typing] Host stopped reading, job #" << job.id << " continues once the send queue drains"
+                          << std::endl;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    keep_untyped(job, typed);
+                    queued_bytes_ += job.text.size();
+                    jobs_.push_front(std::move(job));
+                    busy_ = false;
+                }
+                idle_.notify_all();
+                wait_for_drain();
+                continue;
+            }
+            if (interrupted) {
+                result.status = TypingStatus::Interrupted;
+            } else if (cancel_current_) {
+                result.status = TypingStatus::Cancelled;
+            }
+            if (job.on_complete) {
+                job.on_complete(result);
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (interrupted) {
+                    keep_untyped(job, typed);
+                    if (job.resumable()) {
+                        interrupted_.push_back(std::move(job));
+                    }
+                    link_lost_ = link_lost_ || (link_lost && !stalled);
+                }
+                busy_ = false;
+            }
+            idle_.notify_all();
+            if (stalled) {
+                /* A probe or chord that timed out is dropped, the jobs after it wait for the host */
+                wait_for_drain();
+            }
+        }
+    }
+
+    /* Keep the untyped part, the paste source already points past what was typed */
+    static void keep_untyped(TypingJob &job, size_t typed) {
+        if (!job.stream && !job.paste) {
+            job.text.erase(0, typed - job.resume_offset);
+        }
+        job.resume_offset = typed;
+    }
+
+    /* Block until the host reads the interrupt queue below the send window again */
+    void wait_for_drain() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!stopping_ && !suspending_ && interrupt_window_full(conn_)) {
+            job_ready_.wait_for(lock, std::chrono::milliseconds(50));
+        }
+        if (!stopping_ && !suspending_) {
+            std::cout << "[Typing] Send queue drained, typing resumes" << std::endl;
+        }
+    }
+
+    const BluetoothConnection &conn_;
+    const size_t max_jobs_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable job_ready_;
+    std::condition_variable idle_;
+    std::deque<TypingJob> jobs_;
+    std::vector<TypingJob> interrupted_;    /* Stopped by a lost link or suspend() */
+    size_t queued_bytes_ = 0;
+    bool busy_ = false;
+    bool stopping_ = false;
+    bool link_lost_ = false;                /* A write failed, the queue waits for suspend() */
+    bool suspending_ = false;
+    std::atomic<bool> cancel_current_{false};
+    TypingPacer pacer_;     /* Used by the worker only */
+
+    std::thread worker_;    /* Declared last, started once every member above is ready */
+};
+
+#define MOUSE_MAX_SEGMENTS 64       /* Button changes waiting to be sent */
+#define MOUSE_PATH_MAX_PIXELS 32767 /* Farthest a waypoint may be from the start of its path */
+#define MOUSE_PATH_MAX_SECONDS 60   /* Longest time to reach a waypoint */
+
+/* Point of a mouse path, relative to where the path starts, reached duration seconds after the previous one */
+struct MouseWaypoint {
+    float x;
+    float y;
+    float duration;
+};
+
+/* One report of a path and the time to wait before the next */
+struct MouseStep {
+    int16_t dx;
+    int16_t dy;
+    float delay;
+};
+
+/*
+ * Straight segments between waypoints cut into the fewest reports that
+ * keep each delta within the report's range and, over a duration, move at most once
+ * per report period (and by at least one pixel). Positions stay
+ * fractional, each report sends the whole pixels reached since the last
+ * one so rounding never adds up along the path. Steps are produced on
+ * demand, a long path costs no memory.
+ */
+class MouseTrajectory {
+public:
+    MouseTrajectory(std::vector<MouseWaypoint> waypoints, unsigned rate = mouse_report_rate,
+                    int32_t max_delta = mouse_max_delta())
+        : waypoints_(std::move(waypoints)), rate_(rate > 0 ? rate : 125), max_delta_(max_delta) {
+        start_segment();
+    }
+
+    /* Whether waypoints are finite and within MOUSE_PATH_MAX_PIXELS / MOUSE_PATH_MAX_SECONDS, step counts stay small */
+    static bool valid(const std::vector<MouseWaypoint> &waypoints) {
+        for (const MouseWaypoint &point : waypoints) {
+            if (!(std::fabs(point.x) <= MOUSE_PATH_MAX_PIXELS && std::fabs(point.y) <= MOUSE_PATH_MAX_PIXELS &&
+                  point.duration >= 0.0f && point.duration <= MOUSE_PATH_MAX_SECONDS)) {
+                return false;
+            }
+        }
+        return !waypoints.empty();
+    }
+
+    /* A straight move by dx, dy over duration seconds (0 = as fast as the report rate allows) */
+    static MouseTrajectory line(float dx, float dy, float duration = 0.0f, unsigned rate = mouse_report_rate,
+                                int32_t max_delta = mouse_max_delta()) {
+        return MouseTrajectory({ { dx, dy, duration } }, rate, max_delta);
+    }
+
+    bool next(MouseStep &step) {
+        while (segment_ < waypoints_.size() && step_ == steps_) {
+            from_x_ = waypoints_[segment_].x;
+            from_y_ = waypoints_[segment_].y;
+            segment_++;
+            start_segment();
+        }
+        if (segment_ >= waypoints_.size()) {
+            return false;
+        }
+
+        const MouseWaypoint &to = waypoints_[segment_];
+        step_++;
+        float t = static_cast<float>(step_) / steps_;
+        int32_t x = std::lround(from_x_ + (to.x - from_x_) * t);
+        int32_t y = std::lround(from_y_ + (to.y - from_y_) * t);
+
+        step.dx = static_cast<int16_t>(x - sent_x_);
+        step.dy = static_cast<int16_t>(y - sent_y_);
+        step.delay = to.duration / steps_;
+        sent_x_ = x;
+        sent_y_ = y;
+        return true;
+    }
+
+    /* Reports left, counting the rest of the current segment */
+    size_t remaining_steps() const {
+        size_t count = steps_ - step_;
+        for (size_t i = segment_ + 1; i < waypoints_.size(); i++) {
+            count += segment_steps(waypoints_[i - 1].x, waypoints_[i - 1].y, waypoints_[i]);
+        }
+        return count;
+    }
+
+private:
+    size_t segment_steps(float from_x, float from_y, const MouseWaypoint &to) const {
+        float distance = std::max(std::fabs(to.x - from_x), std::fabs(to.y - from_y));
+
+        /* A rounding carry can add one pixel to a step, keep room for it */
+        size_t needed = static_cast<size_t>(std::ceil((distance + 1.0f) / max_delta_));
+        size_t smooth = std::min(static_cast<size_t>(std::ceil(to.duration * rate_)),
+                                 static_cast<size_t>(std::ceil(distance)));
+        return std::max<size_t>(std::max(needed, smooth), 1);
+    }
+
+    void start_segment() {
+        step_ = 0;
+        steps_ = segment_ < waypoints_.size() ? segment_steps(from_x_, from_y_, waypoints_[segment_]) : 0;
+    }
+
+    std::vector<MouseWaypoint> waypoints_;
+    unsigned rate_;
+    int32_t max_delta_;
+    size_t segment_ = 0;
+    size_t step_ = 0;
+    size_t steps_ = 0;
+    float from_x_ = 0.0f;
+    float from_y_ = 0.0f;
+    int32_t sent_x_ = 0;
+    int32_t sent_y_ = 0;
+};
+
+struct MouseStats {
+    uint64_t events = 0;        /* move() and button calls */
+    uint64_t reports = 0;       /* Reports written */
+    uint64_t deferred = 0;      /* Report slots skipped on a full send window */
+};
+
+/*
+ * Coalescing mouse sender.
+ *
+ * Calling send_mouse() per pointer event writes one report per event and
+ * a fast event source queues motion in the socket faster than the link
+ * drains it. MouseAccumulator sums relative motion and a worker thread
+ * sends at most rate reports per second, so the packet count follows the
+ * rate instead of the event count and motion waits in memory, merged,
+ * rather than in the socket.
+ *
+ * Button changes split the accumulated motion into segments: motion made
+ * before a press is sent before the press, and a press and release
+ * between two flushes still reach the host as two reports. Deltas beyond
+ * the report's range are sent over the following reports. The wheel
+ * counts detents, scaled when the host enabled the hi-res multiplier.
+ *
+ * follow() queues a MouseTrajectory, played with the current buttons
+ * whenever no event motion is waiting.
+ */
+class MouseAccumulator {
+public:
+    explicit MouseAccumulator(const BluetoothConnection &conn, unsigned rate = mouse_report_rate)
+        : conn_(conn), period_(1.0f / (rate > 0 ? rate : 125)),
+          worker_(&MouseAccumulator::run, this) {
+    }
+
+    ~MouseAccumulator() {
+        stop();
+    }
+
+    MouseAccumulator(const MouseAccumulator &) = delete;
+    MouseAccumulator &operator=(const MouseAccumulator &) = delete;
+
+    void move(int32_t dx, int32_t dy, int32_t wheel = 0) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats_.events++;
+        if (segments_.empty()) {
+            segments_.push_back({ buttons_, 0, 0, 0 });
+        }
+        MouseSegment &segment = segments_.back();
+        segment.dx += dx;
+        segment.dy += dy;
+        segment.wheel += wheel * wheel_units_per_detent();
+        pending_.notify_one();
+    }
+
+    void follow(MouseTrajectory path) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats_.events++;
+        paths_.push_back(std::move(path));
+        pending_.notify_one();
+    }
+
+    /* Drop every queued path, including the one playing */
+    void cancel_paths() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        paths_.clear();
+    }
+
+    /* New state of buttons 1-3 (bit 0 = left) */
+    void set_buttons(uint8_t buttons) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats_.events++;
+        if (buttons == buttons_) {
+            return;
+        }
+        buttons_ = buttons;
+
+        /* Out of segments, the newest state wins */
+        if (segments_.size() == MOUSE_MAX_SEGMENTS) {
+            segments_.back().buttons = buttons;
+        } else {
+            segments_.push_back({ buttons, 0, 0, 0 });
+        }
+        pending_.notify_one();
+    }
+
+    void press(uint8_t mask) {
+        set_buttons(button_state() | mask);
+    }
+
+    void release(uint8_t mask) {
+        set_buttons(button_state() & ~mask);
+    }
+
+    uint8_t button_state() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return buttons_;
+    }
+
+    MouseStats stats() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return stats_;
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (stopping_) {
+                return;
+            }
+            stopping_ = true;
+        }
+        pending_.notify_all();
+        if (worker_.joinable()) {
+            worker_.join();
+        }
+    }
+
+private:
+    struct MouseSegment {
+        uint8_t buttons;
+        int32_t dx;
+        int32_t dy;
+        int32_t wheel;
+    };
+
+    /* The limit follows the protocol, the host may switch to boot at any time */
+    int32_t take_delta(int32_t &delta) const {
+        int32_t max_delta = mouse_max_delta();
+        int32_t step = std::clamp(delta, -max_delta, max_delta);
+        delta -= step;
+        return step;
+    }
+
+    void run() {
+        ReportScheduler scheduler;
+        uint8_t sent_buttons = 0;
+
+        while (true) {
+            uint8_t buttons;
+            std::array<int32_t, 3> rel_move;
+            float delay = period_;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                if (segments_.empty() && paths_.empty()) {
+                    pending_.wait(lock, [this] { return !segments_.empty() || !paths_.empty() || stopping_; });
+                    /* At least a period passed since the last report, send right away */
+                    scheduler.restart();
+                }
+                if (stopping_) {
+                    return;
+                }
+
+                /*
+                 * Reports still queued for the host: rather than add one
+                 * more behind them, keep summing and send the motion of
+                 * this slot with the next one.
+                 */
+                if (interrupt_window_full(conn_)) {
+                    stats_.deferred++;
+                    lock.unlock();
+                    scheduler.wait_next(period_);
+                    continue;
+                }
+
+                if (!segments_.empty()) {
+                    MouseSegment &segment = segments_.front();
+                    buttons = segment.buttons;
+                    rel_move = { take_delta(segment.dx), take_delta(segment.dy), take_delta(segment.wheel) };
+                    if (segment.dx == 0 && segment.dy == 0 && segment.wheel == 0) {
+                        segments_.pop_front();
+                    }
+                } else {
+                    MouseStep step;
+                    if (!paths_.front().next(step)) {
+                        paths_.pop_front();
+                        continue;
+                    }
+                    buttons = buttons_;
+                    rel_move = { step.dx, step.dy, 0 };
+                    delay = std::max(step.delay, period_);
+                }
+            }
+
+            /* Nothing left to tell the host (motion summed to zero, a pause in a path) */
+            if (buttons == sent_buttons && rel_move[0] == 0 && rel_move[1] == 0 && rel_move[2] == 0) {
+                if (delay > period_) {
+                    scheduler.wait_next(delay);
+                }
+                continue;
+            }
+
+            if (!send_mouse_motion(conn_, buttons, rel_move[0], rel_move[1], rel_move[2])) {
+                /* The link is gone, don't replay old motion on it */
+                std::lock_guard<std::mutex> lock(mutex_);
+                segments_.clear();
+                paths_.clear();
+                continue;
+            }
+            sent_buttons = buttons;
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stats_.reports++;
+            }
+            scheduler.wait_next(delay);
+        }
+    }
+
+    const BluetoothConnection &conn_;
+    const float period_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable pending_;
+    std::deque<MouseSegment> segments_;
+    std::deque<MouseTrajectory> paths_;
+    uint8_t buttons_ = 0;
+    MouseStats stats_;
+    bool stopping_ = false;
+
+    std::thread worker_;    /* Declared last, started once every member above is ready */
+};
+
+/* Unfinished typing jobs per remote bdaddr, picked up when that host reconnects */
+std::map<std::string, std::vector<TypingJob>> interrupted_jobs;
+
+/* HIDP transaction types, the high nibble of every control message */
+#define HIDP_HANDSHAKE 0x0
+#define HIDP_HID_CONTROL 0x1
+#define HIDP_GET_REPORT 0x4
+#define HIDP_SET_REPORT 0x5
+#define HIDP_GET_PROTOCOL 0x6
+#define HIDP_SET_PROTOCOL 0x7
+#define HIDP_GET_IDLE 0x8
+#define HIDP_SET_IDLE 0x9
+#define HIDP_DATA 0xA
+
+/* HANDSHAKE result codes, the low nibble */
+#define HIDP_HANDSHAKE_SUCCESSFUL 0x0
+#define HIDP_HANDSHAKE_ERR_INVALID_REPORT_ID 0x2
+#define HIDP_HANDSHAKE_ERR_UNSUPPORTED_REQUEST 0x3
+#define HIDP_HANDSHAKE_ERR_INVALID_PARAMETER 0x4
+
+/* HID_CONTROL operations, the low nibble */
+#define HIDP_CONTROL_HARD_RESET 0x1
+#define HIDP_CONTROL_SOFT_RESET 0x2
+#define HIDP_CONTROL_SUSPEND 0x3
+#define HIDP_CONTROL_EXIT_SUSPEND 0x4
+#define HIDP_CONTROL_VIRTUAL_CABLE_UNPLUG 0x5
+
+#define HIDP_GET_REPORT_SIZE 0x08   /* GET_REPORT carries a 2-byte buffer size */
+
+#define HIDP_MAX_CONTROL_MESSAGE 64
+
+bool send_handshake(const BluetoothConnection &conn, uint8_t result) {
+    uint8_t reply = (HIDP_HANDSHAKE << 4) | result;
+    return write(conn.control_client, &reply, 1) >= 0;
+}
+
+/*
+ * Current contents of a report as a DATA message (0xA0 | type, report ID,
+ * payload). Returns an empty vector for reports the active protocol lacks.
+ */
+std::vector<uint8_t> current_report(uint8_t id, HidReportType type) {
+    auto message = [](const auto &report) {
+        return std::vector<uint8_t>(report.bytes.begin(), report.bytes.end());
+    };
+
+    std::lock_guard<std::mutex> lock(host_state_mutex);
+    const HidHostState &state = host_state;
 
-std::map<std::string, uint8_t> keytable = {
-    {"KEY_RESERVED", 0 },
-    {"KEY_ESC", 41 },
-    {"KEY_1", 30},
-    {"KEY_2", 31},
-    {"KEY_3", 32},
-    {"KEY_4", 33},
-    {"KEY_5", 34},
-    {"KEY_6", 35},
-    {"KEY_7", 36},
-    {"KEY_8", 37},
-    {"KEY_9", 38},
-    {"KEY_0", 39},
-    {"KEY_MINUS", 45},
-    {"KEY_EQUAL", 46},
-    {"KEY_BACKSPACE", 42},
-    {"KEY_TAB", 43},
-    {"KEY_Q", 20},
-    {"KEY_W", 26},
-    {"KEY_E", 8},
-    {"KEY_R", 21},
-    {"KEY_T", 23},
-    {"KEY_Y", 28},
-    {"KEY_U", 24},
-    {"KEY_I", 12},
-    {"KEY_O", 18},
-    {"KEY_P", 19},
-    {"KEY_LEFTBRACE", 47},
-    {"KEY_RIGHTBRACE", 48},
-    {"KEY_ENTER", 40},
-    {"KEY_LEFTCTRL", 224},
-    {"KEY_A", 4},
-    {"KEY_S", 22},
-    {"KEY_D", 7},
-    {"KEY_F", 9},
-    {"KEY_G", 10},
-    {"KEY_H", 11},
-    {"KEY_J", 13},
-    {"KEY_K", 14},
-    {"KEY_L", 15},
-    {"KEY_SEMICOLON", 51},
-    {"KEY_APOSTROPHE", 52},
-    {"KEY_GRAVE", 53},
-    {"KEY_LEFTSHIFT", 225},
-    {"KEY_BACKSLASH", 50},
-    {"KEY_Z", 29},
-    {"KEY_X", 27},
-    {"KEY_C", 6},
-    {"KEY_V", 25},
-    {"KEY_B", 5},
-    {"KEY_N", 17},
-    {"KEY_M", 16},
-    {"KEY_COMMA", 54},
-    {"KEY_DOT", 55},
-    {"KEY_SLASH", 56},
-    {"KEY_RIGHTSHIFT", 229},
-    {"KEY_KPASTERISK", 85},
-    {"KEY_LEFTALT", 226},
-    {"KEY_SPACE", 44},
-    {"KEY_CAPSLOCK", 57},
-    {"KEY_F1", 58},
-    {"KEY_F2", 59},
-    {"KEY_F3", 60},
-    {"KEY_F4", 61},
-    {"KEY_F5", 62},
-    {"KEY_F6", 63},
-    {"KEY_F7", 64},
-    {"KEY_F8", 65},
-    {"KEY_F9", 66},
-    {"KEY_F10", 67},
-    {"KEY_NUMLOCK", 83},
-    {"KEY_SCROLLLOCK", 71},
-    {"KEY_KP7", 95},
-    {"KEY_KP8", 96},
-    {"KEY_KP9", 97},
-    {"KEY_KPMINUS", 86},
-    {"KEY_KP4", 92},
-    {"KEY_KP5", 93},
-    {"KEY_KP6", 94},
-    {"KEY_KPPLUS", 87},
-    {"KEY_KP1", 89},
-    {"KEY_KP2", 90},
-    {"KEY_KP3", 91},
-    {"KEY_KP0", 98},
-    {"KEY_KPDOT", 99},
-    {"KEY_ZENKAKUHANKAKU", 148},
-    {"KEY_102ND", 100},
-    {"KEY_F11", 68},
-    {"KEY_F12", 69},
-    {"KEY_RO", 135},
-    {"KEY_KATAKANA", 146},
-    {"KEY_HIRAGANA", 147},
-    {"KEY_HENKAN", 138},
-    {"KEY_KATAKANAHIRAGANA", 136},
-    {"KEY_MUHENKAN", 139},
-    {"KEY_KPJPCOMMA", 140},
-    {"KEY_KPENTER", 88},
-    {"KEY_RIGHTCTRL", 228},
-    {"KEY_KPSLASH", 84},
-    {"KEY_SYSRQ", 70},
-    {"KEY_RIGHTALT", 230},
-    {"KEY_HOME", 74},
-    {"KEY_UP", 82},
-    {"KEY_PAGEUP", 75},
-    {"KEY_LEFT", 80},
-    {"KEY_RIGHT", 79},
-    {"KEY_END", 77},
-    {"KEY_DOWN", 81},
-    {"KEY_PAGEDOWN", 78},
-    {"KEY_INSERT", 73},
-    {"KEY_DELETE", 76},
-    {"KEY_MUTE", 239},
-    {"KEY_VOLUMEDOWN", 238},
-    {"KEY_VOLUMEUP", 237},
-    {"KEY_POWER", 102},
-    {"KEY_KPEQUAL", 103},
-    {"KEY_PAUSE", 72},
-    {"KEY_KPCOMMA", 133},
-    {"KEY_HANGEUL", 144},
-    {"KEY_HANJA", 145},
-    {"KEY_YEN", 137},
-    {"KEY_LEFTMETA", 227},
-    {"KEY_RIGHTMETA", 231},
-    {"KEY_COMPOSE", 101},
-    {"KEY_STOP", 243},
-    {"KEY_AGAIN", 121},
-    {"KEY_PROPS", 118},
-    {"KEY_UNDO", 122},
-    {"KEY_FRONT", 119},
-    {"KEY_COPY", 124},
-    {"KEY_OPEN", 116},
-    {"KEY_PASTE", 125},
-    {"KEY_FIND", 244},
-    {"KEY_CUT", 123},
-    {"KEY_HELP", 117},
-    {"KEY_CALC", 251},
-    {"KEY_SLEEP", 248},
-    {"KEY_WWW", 240},
-    {"KEY_COFFEE", 249},
-    {"KEY_BACK", 241},
-    {"KEY_FORWARD", 242},
-    {"KEY_EJECTCD", 236},
-    {"KEY_NEXTSONG", 235},
-    {"KEY_PLAYPAUSE", 232},
-    {"KEY_PREVIOUSSONG", 234},
-    {"KEY_STOPCD", 233},
-    {"KEY_REFRESH", 250},
-    {"KEY_EDIT", 247},
-    {"KEY_SCROLLUP", 245},
-    {"KEY_SCROLLDOWN", 246},
-    {"KEY_F13", 104},
-    {"KEY_F14", 105},
-    {"KEY_F15", 106},
-    {"KEY_F16", 107},
-    {"KEY_F17", 108},
-    {"KEY_F18", 109},
-    {"KEY_F19", 110},
-    {"KEY_F20", 111},
-    {"KEY_F21", 112},
-    {"KEY_F22", 113},
-    {"KEY_F23", 114},
-    {"KEY_F24", 115}
-};
-
-std::map<std::string, int> modkeys = {
-    {"KEY_RIGHTMETA", 0},
-    {"KEY_RIGHTALT", 1},
-    {"KEY_RIGHTSHIFT", 2},
-    {"KEY_RIGHTCTRL", 3},
-    {"KEY_LEFTMETA", 4},
-    {"KEY_LEFTALT", 5},
-    {"KEY_LEFTSHIFT", 6},
-    {"KEY_LEFTCTRL", 7}
-};
-
-int convert(const std::string& evdev_keycode) {
-    if (keytable.find(evdev_keycode) != keytable.end()) {
-        return keytable[evdev_keycode];
-    } else {
-        std::cerr << "Key not found: " << evdev_keycode << std::endl;
-        return -1; 
+    if (boot_protocol_active()) {
+        if (type == HidReportType::Input && id == HID_REPORT_KEYBOARD) {
+            return message(state.keyboard);
+        } else if (type == HidReportType::Input && id == HID_REPORT_MOUSE) {
+            std::array<uint8_t, 5> report = boot_mouse_report(state.buttons, 0, 0);
+            return std::vector<uint8_t>(report.begin(), report.end());
+        }
+        return {};
     }
-}
 
-int modkey(const std::string& evdev_keycode) {
-    if (modkeys.find(evdev_keycode) != modkeys.end()) {
-        return modkeys[evdev_keycode];
-    } else {
-        return -1;
+    if (type == HidReportType::Input) {
+        switch (id) {
+        case HID_REPORT_KEYBOARD: return message(state.keyboard);
+        case HID_REPORT_MOUSE: return message(mouse_input_report(state.buttons, { 0, 0, 0 }));
+        case HID_REPORT_ABSOLUTE:
+            return message(absolute_input_report(state.buttons, state.absolute_x, state.absolute_y));
+        case HID_REPORT_HIRES_MOUSE: return message(hires_mouse_input_report(state.buttons, 0, 0, 0));
+        case HID_REPORT_NKRO: return message(state.nkro);
+        }
+    } else if (type == HidReportType::Output && id == HID_REPORT_KEYBOARD) {
+        KeyboardOutputReport report;
+        report.set_bits<HID_USAGE_NUM_LOCK, 5>(state.leds);
+        return message(report);
+    } else if (type == HidReportType::Feature && id == HID_REPORT_HIRES_MOUSE) {
+        return message(hires_feature_report());
     }
+    return {};
 }
 
-bool send_keys(const BluetoothConnection &conn, uint8_t modifier_byte, const std::array<uint8_t, 6> &keys) {
-    /* HID input report: 10 bytes
-     *   0  : Button states (buttons 1-8)
-     *   1  : Additional buttons
-     * 2 - 3: X-axis of the joystick
-     * 4 - 5: Y-axis of the joystick
-     * 6 - 7: Z-axis or trigger
-     * 8 - 9: Other information / padding
-     */
-    uint8_t cmd_bytes[10];
-
-    /* 1. Prefix (Bluetooth HID) */
-    cmd_bytes[0] = 0xA1;            // HID input report prefix 
-    cmd_bytes[1] = 0x01;            // Report ID 
-    cmd_bytes[2] = modifier_byte;   // Modifier byte (Ctrl, Shift, Alt...)
-    cmd_bytes[3] = 0x00;            // Reserved byte (always zero)
-
-    size_t num_keys = keys.size() < 6 ? keys.size() : 6;
-    
-    /* 2. Copy key_array into cmd_bytes */
-    memcpy(&cmd_bytes[4], keys.data(), num_keys);
+/*
+ * Apply an output or feature report from the host, payload without the
+ * report ID. Returns the HANDSHAKE result for SET_REPORT.
+ */
+uint8_t apply_host_report(uint8_t id, HidReportType type, const uint8_t *payload, size_t len) {
+    size_t expected = hid_layout.report_bytes(id, type);
+    if (expected == 0) {
+        return HIDP_HANDSHAKE_ERR_INVALID_REPORT_ID;
+    } else if (len < expected) {
+        return HIDP_HANDSHAKE_ERR_INVALID_PARAMETER;
+    }
 
-    /* 3. Send HID Report through interupt channel */
-    ssize_t bytes_sent = write(conn.interrupt_client, cmd_bytes, sizeof(cmd_bytes));
-    if (bytes_sent < 0) {
-        return false;
-    } else {
-        return true;
+    if (type == HidReportType::Output && id == HID_REPORT_KEYBOARD) {
+        KeyboardOutputReport report = KeyboardOutputReport::from_payload(payload, len);
+        uint8_t leds = report.get_bits<HID_USAGE_NUM_LOCK, 5>();
+        std::lock_guard<std::mutex> lock(host_state_mutex);
+        if ((leds ^ host_state.leds) & HID_LED_CAPS_LOCK) {
+            std::cout << "[HID] Host Caps Lock " << (leds & HID_LED_CAPS_LOCK ? "on" : "off") << std::endl;
+        }
+        host_state.leds = leds;
+        host_state.led_reports++;
+        host_state.led_report_ns = monotonic_now_ns();
+        host_leds_changed.notify_all();
+        return HIDP_HANDSHAKE_SUCCESSFUL;
+    } else if (type == HidReportType::Feature && id == HID_REPORT_HIRES_MOUSE) {
+        set_hires_feature_report(payload, len);
+        return HIDP_HANDSHAKE_SUCCESSFUL;
     }
+    /* Input reports are ours to send */
+    return HIDP_HANDSHAKE_ERR_INVALID_PARAMETER;
 }
 
-bool send_mouse(const BluetoothConnection &conn, uint8_t buttons, const std::array<int8_t, 3> &rel_move) {
-    /* 
-     * Mouse HID Report Format
-     * Byte 0: Button
-     * Byte 1: X movement (relative)
-     * Byte 2: Y movement (relative)
-     * Byte 2: Y movement (relative)
-     * Byte 3: Wheel movement 
-     */
+void answer_get_report(const BluetoothConnection &conn, const uint8_t *msg, size_t len) {
+    uint8_t param = msg[0] & 0x0F;
+    HidReportType type = static_cast<HidReportType>(param & 0x03);
+    bool has_size = param & HIDP_GET_REPORT_SIZE;
 
-    /* Check connection is available? */
-    if (conn.interrupt_client <= 0) {
-        std::cerr << "Interrupt client socket not connected!" << std::endl;
-        return false;
+    if (len < (has_size ? 4u : 2u) || (param & 0x03) == 0) {
+        send_handshake(conn, HIDP_HANDSHAKE_ERR_INVALID_PARAMETER);
+        return;
     }
 
-    uint8_t cmd_bytes[6];
-
-    cmd_bytes[0] = 0xA1;
-    cmd_bytes[1] = 0x02;
-    cmd_bytes[2] = buttons;
-    cmd_bytes[3] = rel_move[0];
-    cmd_bytes[4] = rel_move[1];
-    cmd_bytes[5] = rel_move[2];
+    std::vector<uint8_t> reply = current_report(msg[1], type);
+    if (reply.empty()) {
+        send_handshake(conn, HIDP_HANDSHAKE_ERR_INVALID_REPORT_ID);
+        return;
+    }
 
-    /* Send data report through interrupt socket */
-    ssize_t bytes_sent = write(conn.interrupt_client, cmd_bytes, sizeof(cmd_bytes));
+    /* The buffer size limits what follows the header, report ID included */
+    if (has_size) {
+        size_t buffer_size = msg[2] | (msg[3] << 8);
+        reply.resize(std::min(reply.size(), 1 + buffer_size));
+    }
+    if (write(conn.control_client, reply.data(), reply.size()) < 0) {
+        perror("Error answering GET_REPORT");
+    }
+}
 
-    if (bytes_sent < 0) {
-        perror("Error sending mouse report to interrupt channel");
+/*
+ * HID_CONTROL from the host. Returns false when the host unplugged the
+ * virtual cable: both channels are shut down and the connection ends.
+ */
+bool handle_hid_control(const BluetoothConnection &conn, uint8_t operation) {
+    switch (operation) {
+    case HIDP_CONTROL_HARD_RESET:
+    case HIDP_CONTROL_SOFT_RESET:
+        hid_protocol = HidProtocol::Report;
+        reset_host_state();
+        std::cout << "[HID] Host reset the device" << std::endl;
+        break;
+    case HIDP_CONTROL_SUSPEND:
+    case HIDP_CONTROL_EXIT_SUSPEND: {
+        bool suspended = operation == HIDP_CONTROL_SUSPEND;
+        std::lock_guard<std::mutex> lock(host_state_mutex);
+        host_state.suspended = suspended;
+        std::cout << "[HID] Host " << (suspended ? "suspended" : "resumed") << std::endl;
+        break;
+    }
+    case HIDP_CONTROL_VIRTUAL_CABLE_UNPLUG: {
+        std::cout << "[HID] Host unplugged the virtual cable" << std::endl;
+        {
+            std::lock_guard<std::mutex> lock(host_state_mutex);
+            host_state.unplugged = true;
+        }
+        shutdown(conn.interrupt_client, SHUT_RDWR);
+        shutdown(conn.control_client, SHUT_RDWR);
         return false;
     }
-
-    /* Debug - optional */
-    std::cout << "Sending mouse report -> "
-              << "Buttons: " << (int)buttons
-              << ", X: " << (int)rel_move[0]
-              << ", Y: " << (int)rel_move[1]
-              << ", Wheel: " << (int)rel_move[2]
-              << std::endl;
-
+    }
     return true;
 }
 
-void send_string_input(const BluetoothConnection &conn, const std::string &text, float key_down_time = 0.01, float key_delay = 0.05) {
-    for (const char &c : text) {
-        if (c < 32 || c > 126) {
-            std::cerr << "Skipping unsupported character: " << c << std::endl;
-            continue;
-        }
-
-        std::string key_name = "KEY_"; 
-        key_name += static_cast<char>(std::toupper(c)); // a -> A
+/*
+ * Read and answer one message the host sent on the control channel.
+ * Returns false once the host closed the channel or unplugged the cable.
+ */
+bool handle_control_message(const BluetoothConnection &conn) {
+    uint8_t msg[HIDP_MAX_CONTROL_MESSAGE];
+    ssize_t len = recv(conn.control_client, msg, sizeof(msg), MSG_DONTWAIT);
+    if (len == 0) {
+        return false;
+    } else if (len < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
 
-        int hid_code = convert(key_name);
-        if (hid_code < 0) {
-            std::cerr << "Key not found in keytable for character: " << c << std::endl;
-            continue;
+    uint8_t type = msg[0] >> 4;
+    uint8_t param = msg[0] & 0x0F;
+
+    switch (type) {
+    case HIDP_HID_CONTROL:
+        return handle_hid_control(conn, param);
+    case HIDP_GET_REPORT:
+        answer_get_report(conn, msg, len);
+        break;
+    case HIDP_SET_REPORT:
+        if (len < 2 || (param & 0x03) == 0) {
+            send_handshake(conn, HIDP_HANDSHAKE_ERR_INVALID_PARAMETER);
+        } else {
+            send_handshake(conn, apply_host_report(msg[1], static_cast<HidReportType>(param & 0x03), msg + 2, len - 2));
         }
-
-        uint8_t modifier = 0;
-
-        /* CAPITAL characters */
-        if (std::isupper(c)) {
-            modifier |= (1 << modkeys["KEY_LEFTSHIFT"]);
+        break;
+    case HIDP_GET_PROTOCOL: {
+        uint8_t reply[2] = { HIDP_DATA << 4, static_cast<uint8_t>(hid_protocol.load()) };
+        if (write(conn.control_client, reply, sizeof(reply)) < 0) {
+            perror("Error answering GET_PROTOCOL");
         }
-
-        /* SPECIAL characters */
-        const std::string special_chars = "!@#$%^&*()_+{}|:\"<>?";
-        if (special_chars.find(c) != std::string::npos) {
-            modifier |= (1 << modkeys["KEY_LEFTSHIFT"]);
+        break;
+    }
+    case HIDP_SET_PROTOCOL: {
+        HidProtocol protocol = (param & 0x01) ? HidProtocol::Report : HidProtocol::Boot;
+        if (hid_protocol.exchange(protocol) != protocol) {
+            std::cout << "[HID] Host switched to "
+                      << (protocol == HidProtocol::Boot ? "boot" : "report") << " protocol" << std::endl;
         }
+        send_handshake(conn, HIDP_HANDSHAKE_SUCCESSFUL);
+        break;
+    }
+    case HIDP_GET_IDLE: {
+        std::lock_guard<std::mutex> lock(host_state_mutex);
+        uint8_t reply[2] = { HIDP_DATA << 4, host_state.idle_rate };
+        if (write(conn.control_client, reply, sizeof(reply)) < 0) {
+            perror("Error answering GET_IDLE");
+        }
+        break;
+    }
+    case HIDP_SET_IDLE:
+        if (len < 2) {
+            send_handshake(conn, HIDP_HANDSHAKE_ERR_INVALID_PARAMETER);
+        } else {
+            {
+                std::lock_guard<std::mutex> lock(host_state_mutex);
+                host_state.idle_rate = msg[1];
+            }
+            send_handshake(conn, HIDP_HANDSHAKE_SUCCESSFUL);
+        }
+        break;
+    case HIDP_DATA:
+        /* Unacknowledged output report sent on the control channel */
+        if (len >= 2 && (param & 0x03) == static_cast<uint8_t>(HidReportType::Output)) {
+            apply_host_report(msg[1], HidReportType::Output, msg + 2, len - 2);
+        }
+        break;
+    case HIDP_HANDSHAKE:
+        break;
+    default:
+        send_handshake(conn, HIDP_HANDSHAKE_ERR_UNSUPPORTED_REQUEST);
+        break;
+    }
+    return true;
+}
 
-        std::array<uint8_t, 6> keys = { static_cast<uint8_t>(hid_code), 0, 0, 0, 0, 0 };
-
-        /* Press key */
-        send_keys(conn, modifier, keys);
-        std::this_thread::sleep_for(std::chrono::duration<float>(key_down_time));
+/*
+ * Read one message the host sent on the interrupt channel, where it
+ * writes output reports (keyboard LEDs) without a handshake.
+ * Returns false once the host closed the channel.
+ */
+bool handle_interrupt_message(const BluetoothConnection &conn) {
+    uint8_t msg[HIDP_MAX_CONTROL_MESSAGE];
+    ssize_t len = recv(conn.interrupt_client, msg, sizeof(msg), MSG_DONTWAIT);
+    if (len == 0) {
+        return false;
+    } else if (len < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
 
-        /* Release key */
-        std::array<uint8_t, 6> empty_keys = { 0, 0, 0, 0, 0, 0 };
-        send_keys(conn, 0, empty_keys);
-        std::this_thread::sleep_for(std::chrono::duration<float>(key_delay));
+    if (len >= 2 && msg[0] == ((HIDP_DATA << 4) | static_cast<uint8_t>(HidReportType::Output))) {
+        apply_host_report(msg[1], HidReportType::Output, msg + 2, len - 2);
     }
+    return true;
 }
 
 /*
@@ -561,12 +4873,29 @@ void send_string_input(const BluetoothConnection &conn, const std::string &text,
 
 void non_blocking_input(BluetoothConnection &bt_conn){
 
+    /* Every connection starts in report protocol until the host asks for boot */
+    hid_protocol = HidProtocol::Report;
+    reset_host_state();
+
     std::cout << "\n";
     std::cout << "╔══════════════════════════════════╗" << std::endl;
     std::cout << "║        HID Report Sender         ║" << std::endl;
     std::cout << "╠══════════════════════════════════╣" << std::endl;
     std::cout << "║  [m] Send mouse input            ║" << std::endl;
     std::cout << "║  [Type] Send keyboard input      ║" << std::endl;
+    std::cout << "║  [/paste <file>] Stream a file   ║" << std::endl;
+    std::cout << "║  [/replay <file>] Replay reports ║" << std::endl;
+    std::cout << "║  [/move x y [ms]] Move pointer   ║" << std::endl;
+    std::cout << "║  [/path x y ms ...] Waypoints    ║" << std::endl;
+    std::cout << "║  [/pos x y] Pointer at 0..1      ║" << std::endl;
+    std::cout << "║  [/chord keys...] Press at once  ║" << std::endl;
+    std::cout << "║  [/cad] Send Ctrl+Alt+Del        ║" << std::endl;
+    std::cout << "║  [/cancel] Stop queued typing    ║" << std::endl;
+    std::cout << "║  [/status] Show typing queue     ║" << std::endl;
+    std::cout << "║  [/probe] Measure host latency   ║" << std::endl;
+    std::cout << "║  [/rtt] Show latency histogram   ║" << std::endl;
+    std::cout << "║  [/profile] Show saved settings  ║" << std::endl;
+    std::cout << "║  [/forget [field]] Clear saved   ║" << std::endl;
     std::cout << "║  [q] Quit program                ║" << std::endl;
     std::cout << "╚══════════════════════════════════╝" << std::endl;
     std::cout << "Input >>> ";
@@ -574,30 +4903,125 @@ void non_blocking_input(BluetoothConnection &bt_conn){
 
     std::string input;
 
+    /* Settings saved for this host, see HostProfileDb */
+    remember_host(bt_conn);
+    TypingOptions host_options = typing_options_for_host(bt_conn);
+
+    /* Typing runs in the background so this loop keeps watching the connection */
+    TypingSender typing_sender(bt_conn, 32, typing_rate_for_host(bt_conn));
+    MouseAccumulator mouse(bt_conn, mouse_rate_for_host(bt_conn));
+
+    std::cout << "Typing with " << (host_options.layout ? host_options.layout->name() : "us")
+              << " keyboard layout, " << (host_options.keyboard_mode == KeyboardMode::Nkro ? "NKRO" : "6KRO")
+              << " reports";
+    if (host_options.adaptive_rate) {
+        std::cout << ", " << std::lround(typing_sender.pacer().rate()) << " reports/s";
+    }
+    std::cout << std::endl;
+
+    auto unfinished = interrupted_jobs.find(remote_address(bt_conn));
+    if (unfinished != interrupted_jobs.end()) {
+        std::cout << "[Typing] Resuming " << unfinished->second.size() << " job(s)" << std::endl;
+        typing_sender.resume(std::move(unfinished->second));
+        interrupted_jobs.erase(unfinished);
+    }
+
+    /* Completion callback of a job counting its progress in unit ("bytes", "reports") */
+    auto job_done = [](const char *unit) {
+        return [unit](const TypingResult &result) {
+            if (result.status == TypingStatus::Completed) {
+                const SchedulerStats &timing = result.timing;
+                std::cout << "[Typing] Job #" << result.job_id << " done ("
+                          << result.total << " " << unit << " in " << result.elapsed_ns / 1000000 << " ms";
+                if (timing.reports > 0) {
+                    std::cout << ", lateness avg " << timing.total_lateness_ns / timing.reports / 1000
+                              << " us, max " << timing.max_lateness_ns / 1000 << " us";
+                }
+                std::cout << ")" << std::endl;
+            } else if (result.status == TypingStatus::Interrupted) {
+                std::cout << "[Typing] Job #" << result.job_id << " interrupted after "
+                          << result.typed << "/" << result.total << " " << unit << ", resumes on reconnect" << std::endl;
+            } else {
+                std::cout << "[Typing] Job #" << result.job_id << " cancelled after "
+                          << result.typed << "/" << result.total << " " << unit << std::endl;
+            }
+        };
+    };
+
+    /* Latency probes run while typing is idle, see probe_latency() */
+    std::string host_addr = remote_address(bt_conn);
+    int64_t last_probe_ns = monotonic_now_ns();
+
     bool running = true;
+    bool control_open = true;
+    bool interrupt_open = true;
     
     while (running) {
         fd_set readfds;
         FD_ZERO(&readfds);
         FD_SET(STDIN_FILENO, &readfds);
+        int max_fd = STDIN_FILENO;
+        if (control_open) {
+            FD_SET(bt_conn.control_client, &readfds);
+            max_fd = std::max(max_fd, bt_conn.control_client);
+        }
+        if (interrupt_open) {
+            FD_SET(bt_conn.interrupt_client, &readfds);
+            max_fd = std::max(max_fd, bt_conn.interrupt_client);
+        }
 
         struct timeval tv;
         tv.tv_sec = 0;
         tv.tv_usec = 500000;  // 500ms
 
-        int retval = select(STDIN_FILENO + 1, &readfds, NULL, NULL, &tv);
+        int retval = select(max_fd + 1, &readfds, NULL, NULL, &tv);
 
         if (retval == -1) {
             perror("select()");
             break;
-        } else if (retval) { 
+        }
+
+        /* Requests from the host (protocol, reports) */
+        if (control_open && FD_ISSET(bt_conn.control_client, &readfds)) {
+            control_open = handle_control_message(bt_conn);
+        }
+        if (interrupt_open && FD_ISSET(bt_conn.interrupt_client, &readfds)) {
+            interrupt_open = handle_interrupt_message(bt_conn);
+        }
+
+        if (rtt_probe_interval > 0 &&
+            monotonic_now_ns() - last_probe_ns >= int64_t(rtt_probe_interval) * 1000000000LL) {
+            last_probe_ns = monotonic_now_ns();
+            bool host_suspended;
+            {
+                std::lock_guard<std::mutex> lock(host_state_mutex);
+                host_suspended = host_state.suspended;
+            }
+            /* A suspended host must not be woken up by a probe */
+            if (!host_suspended && typing_sender.queue_depth() == 0 && rtt_probe_answered(host_addr)) {
+                typing_sender.enqueue_probe();
+            }
+        }
+
+        if (FD_ISSET(STDIN_FILENO, &readfds)) { 
             /* Have data into input */
-            std::getline(std::cin, input);
+            bool end_of_input = !std::getline(std::cin, input);
+            if (end_of_input) {
+                /* Text piped in: type all of it before quitting */
+                std::cout << "End of input, waiting for queued typing..." << std::endl;
+                typing_sender.flush();
+            }
 
-            if (input == "q") {
+            if (end_of_input || input == "q") {
 
                 std::cout << "Quit program!" << std::endl;
 
+                typing_sender.stop();
+                if (host_options.adaptive_rate) {
+                    remember_typing_rate(bt_conn, typing_sender.pacer().rate());
+                }
+                host_profiles.reset();
+                mouse.stop();
                 cleanup_connection(bt_conn); /* Clean socket & client */
     
                 if (loop) 
@@ -612,23 +5036,241 @@ void non_blocking_input(BluetoothConnection &bt_conn){
             } else if (input == "m") {
 
                 std::cout << "Send mouse" << std::endl;
-                std::array<int8_t, 3> mouse_move = {10, 30, 1};
+                mouse.move(10, 30, 1);
+
+            } else if (input.compare(0, 6, "/move ") == 0 || input.compare(0, 6, "/path ") == 0) {
+
+                /*
+                 * Smooth pointer move: /move <dx> <dy> [milliseconds], or through
+                 * waypoints relative to the start: /path <x> <y> <ms> [<x> <y> <ms> ...]
+                 */
+                bool line = input[1] == 'm';
+                std::istringstream args(input.substr(6));
+                std::vector<float> values;
+                float value;
+                while (args >> value) {
+                    values.push_back(value);
+                }
+                if (line && values.size() == 2) {
+                    values.push_back(0.0f);
+                }
+                std::vector<MouseWaypoint> waypoints;
+                for (size_t i = 0; i + 2 < values.size(); i += 3) {
+                    waypoints.push_back({ values[i], values[i + 1], values[i + 2] / 1000.0f });
+                }
+                if (!args.eof() || values.size() % 3 != 0 || (line && waypoints.size() != 1) ||
+                    !MouseTrajectory::valid(waypoints)) {
+                    std::cerr << (line ? "Usage: /move <dx> <dy> [ms]" : "Usage: /path <x> <y> <ms> ...")
+                              << ", within " << MOUSE_PATH_MAX_PIXELS << " pixels and " << MOUSE_PATH_MAX_SECONDS
+                              << " s" << std::endl;
+                } else {
+                    MouseTrajectory path(waypoints);
+                    std::cout << "[Mouse] Moving to " << waypoints.back().x << "," << waypoints.back().y << " in "
+                              << path.remaining_steps() << " reports" << std::endl;
+                    mouse.follow(std::move(path));
+                }
+
+            } else if (input.compare(0, 5, "/pos ") == 0) {
+
+                /* Absolute pointer: /pos <x> <y>, 0..1 from the top left corner */
+                std::istringstream args(input.substr(5));
+                float x, y;
+                if (!(args >> x >> y)) {
+                    std::cerr << "Usage: /pos <x> <y>" << std::endl;
+                } else if (!send_absolute(bt_conn, mouse.button_state(), x, y)) {
+                    std::cerr << "Failed to send pointer report!" << std::endl;
+                }
+
+            } else if (input.compare(0, 7, "/chord ") == 0) {
+
+                /* Keys pressed together, as in layout files: /chord ctrl+alt+0x4C, /chord 0x04 0x05 0x06 ... */
+                std::istringstream args(input.substr(7));
+                std::string token;
+                uint8_t modifier = 0;
+                std::vector<uint8_t> usages;
+                bool valid = true;
+                while (args >> token) {
+                    KeyStroke stroke;
+                    valid = valid && parse_layout_stroke(token, stroke);
+                    modifier |= stroke.modifier;
+                    usages.push_back(stroke.usage);
+                }
+                if (!valid || usages.empty()) {
+                    std::cerr << "Usage: /chord [mods+]<usage> ..." << std::endl;
+                } else if (fit_chord(modifier, usages, active_keyboard_mode(host_options.keyboard_mode))) {
+                    /* Queued behind the typing, the worker owns the keyboard report */
+                    uint64_t id = typing_sender.enqueue_chord(modifier, usages, [](const TypingResult &result) {
+                        if (result.status == TypingStatus::Completed && result.typed == 0) {
+                            std::cerr << "Failed to send chord!" << std::endl;
+                        }
+                    }, host_options);
+                    if (id == 0) {
+                        std::cerr << "Typing queue is full, chord dropped!" << std::endl;
+                    }
+                }
+
+            } else if (input == "/cad") {
+
+                if (typing_sender.enqueue_keys(ctrl_alt_del, nullptr, host_options) == 0) {
+                    std::cerr << "Typing queue is full, Ctrl+Alt+Del dropped!" << std::endl;
+                }
+
+            } else if (input == "/cancel") {
+
+                typing_sender.cancel();
+                mouse.cancel_paths();
+
+            } else if (input.compare(0, 8, "/replay ") == 0) {
+
+                std::shared_ptr<const ReportStream> stream = ReportStream::open(input.substr(8));
+                if (stream) {
+                    uint64_t job_id = typing_sender.enqueue_replay(stream, job_done("reports"));
+                    if (job_id == 0) {
+                        std::cerr << "Typing queue is full, replay dropped!" << std::endl;
+                    } else {
+                        std::cout << "[Typing] Queued replay #" << job_id << " ("
+                                  << stream->header().record_count << " reports)" << std::endl;
+                    }
+                }
+
+            } else if (input.compare(0, 7, "/paste ") == 0) {
+
+                std::shared_ptr<PasteSource> source = PasteSource::open(input.substr(7));
+                if (source) {
+                    auto progress = [](const PasteProgress &progress) {
+                        std::cout << "[Paste] " << progress.typed;
+                        if (progress.total > 0) {
+                            std::cout << "/" << progress.total << " bytes ("
+                                      << progress.typed * 100 / progress.total << "%)";
+                        } else {
+                            std::cout << " bytes";
+                        }
+                        std::cout << ", " << progress.chars << " chars, "
+                                  << static_cast<int>(progress.chars_per_sec) << " chars/s" << std::endl;
+                    };
+
+                    uint64_t job_id = typing_sender.enqueue_paste(source, job_done("bytes"), progress, host_options);
+                    if (job_id == 0) {
+                        std::cerr << "Typing queue is full, paste dropped!" << std::endl;
+                    } else {
+                        std::cout << "[Typing] Queued paste #" << job_id << " from " << source->path << std::endl;
+                    }
+                }
+
+            } else if (input == "/probe") {
+
+                typing_sender.enqueue_probe([host_addr](const TypingResult &result) {
+                    std::lock_guard<std::mutex> lock(host_rtt_mutex);
+                    std::cout << "[RTT] " << result.typed << "/" << result.total << " taps answered";
+                    if (result.typed > 0) {
+                        std::cout << ", last " << host_rtt[host_addr].last_ns / 1000 << " us";
+                    }
+                    std::cout << std::endl;
+                });
+
+            } else if (input == "/profile") {
+
+                const HostProfileRecord *profile = host_profile(bt_conn);
+                if (!profile) {
+                    std::cout << "[Profile] No saved settings for " << host_addr << std::endl;
+                } else {
+                    std::cout << "[Profile] " << host_addr << ": " << profile->connections << " connection(s)";
+                    if (profile->fields & PROFILE_TYPING_RATE) {
+                        std::cout << ", typing " << std::lround(profile->typing_rate) << " reports/s";
+                    }
+                    if (profile->fields & PROFILE_KEYBOARD_MODE) {
+                        std::cout << ", " << (profile->keyboard_mode == static_cast<uint8_t>(KeyboardMode::Nkro) ? "nkro" : "6kro");
+                    }
+                    if (profile->fields & PROFILE_LAYOUT) {
+                        std::cout << ", layout " << std::string(profile->layout, strnlen(profile->layout, sizeof(profile->layout)));
+                    }
+                    if (profile->fields & PROFILE_MOUSE_RATE) {
+                        std::cout << ", mouse " << profile->mouse_rate << " Hz";
+                    }
+                    if ((profile->fields & PROFILE_UNICODE_METHOD) && profile->unicode_method <= static_cast<uint8_t>(UnicodeMethod::MacOS)) {
+                        std::cout << ", unicode " << unicode_method_name(static_cast<UnicodeMethod>(profile->unicode_method));
+                    }
+                    std::cout << std::endl;
+                }
+
+            } else if (input == "/forget" || input.rfind("/forget ", 0) == 0) {
+
+                static const std::map<std::string, uint8_t> profile_fields = {
+                    { "rate", PROFILE_TYPING_RATE }, { "mode", PROFILE_KEYBOARD_MODE }, { "layout", PROFILE_LAYOUT },
+                    { "mouse", PROFILE_MOUSE_RATE }, { "unicode", PROFILE_UNICODE_METHOD },
+                };
+                std::string name = input.size() > 8 ? input.substr(8) : std::string();
+                auto field = profile_fields.find(name);
+                if (!name.empty() && field == profile_fields.end()) {
+                    std::cout << "Usage: /forget [rate|mode|layout|mouse|unicode]" << std::endl;
+                } else if (forget_host_fields(bt_conn, name.empty() ? 0xFF : field->second)) {
+                    std::cout << "[Profile] Cleared " << (name.empty() ? "all settings" : name) << " saved for "
+                              << host_addr << ", effective from the next connection" << std::endl;
+                } else {
+                    std::cout << "[Profile] No saved settings for " << host_addr << std::endl;
+                }
+
+            } else if (input == "/rtt") {
 
-                if (!send_mouse(bt_conn, 0, mouse_move)) {
-                    std::cerr << "Failed to send mouse report!" << std::endl;
+                std::lock_guard<std::mutex> lock(host_rtt_mutex);
+                std::cout << "[RTT] " << host_addr << ": ";
+                host_rtt[host_addr].print(std::cout);
+
+            } else if (input == "/status") {
+
+                std::cout << "Typing queue: " << typing_sender.queue_depth() << " job(s), "
+                          << typing_sender.queued_bytes() << " bytes waiting" << std::endl;
+                if (host_options.adaptive_rate) {
+                    std::cout << "Typing rate: " << std::lround(typing_sender.pacer().rate()) << " reports/s, "
+                              << typing_sender.pacer().decreases() << " backoffs" << std::endl;
+                }
+                MouseStats mouse_stats = mouse.stats();
+                std::cout << "Mouse: " << mouse_stats.events << " events in "
+                          << mouse_stats.reports << " reports, " << mouse_stats.deferred << " deferred" << std::endl;
+                std::cout << "Interrupt queue: " << interrupt_queued_bytes(bt_conn) << "/" << interrupt_send_window
+                          << " bytes, " << interrupt_stats.stalls << " stalls, "
+                          << interrupt_stats.dropped << " dropped, " << interrupt_stats.timeouts << " timed out" << std::endl;
+                std::cout << "Protocol: " << (boot_protocol_active() ? "boot" : "report");
+                {
+                    std::lock_guard<std::mutex> lock(host_state_mutex);
+                    std::cout << ", LEDs 0x" << std::hex << (int)host_state.leds << std::dec
+                              << ", idle " << (int)host_state.idle_rate * 4 << " ms"
+                              << (host_state.suspended ? ", host suspended" : "") << std::endl;
                 }
 
             } else {
                 std::cout << "Send messages" << std::endl;
 
-                send_string_input(bt_conn, input);
+                uint64_t job_id = typing_sender.enqueue(input, job_done("bytes"), host_options);
+                if (job_id == 0) {
+                    std::cerr << "Typing queue is full, message dropped!" << std::endl;
+                } else {
+                    std::cout << "[Typing] Queued job #" << job_id << std::endl;
+                }
             }
         } else {
             /* No data input */
             if (!is_connected(bt_conn.control_client) && !is_connected(bt_conn.interrupt_client)) {
 
                 std::cout << "Device disconnected!" << std::endl;
-                
+
+                /* Keep what wasn't typed for the next connection from this host, unless it unplugged us */
+                std::vector<TypingJob> jobs = typing_sender.suspend();
+                bool unplugged;
+                {
+                    std::lock_guard<std::mutex> lock(host_state_mutex);
+                    unplugged = host_state.unplugged;
+                }
+                if (unplugged) {
+                    interrupted_jobs.erase(remote_address(bt_conn));
+                } else if (!jobs.empty()) {
+                    interrupted_jobs[remote_address(bt_conn)] = std::move(jobs);
+                }
+                typing_sender.stop();
+                mouse.stop();
+                if (host_options.adaptive_rate) {
+                    remember_typing_rate(bt_conn, typing_sender.pacer().rate());
+                }
                 cleanup_connection(bt_conn); 
                 
                 running = false;
@@ -826,6 +5468,145 @@ void auto_paring_agent() {
 }    
 
 
+#define HID_MAX_DESCRIPTOR 1024
+
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/*
+ * Find the hex encoded report descriptor of attribute 0x0206 in an SDP
+ * record and decode it into out. Returns the descriptor length, 0 when
+ * it is missing or malformed.
+ */
+size_t extract_sdp_descriptor(const std::string &record, std::array<uint8_t, HID_MAX_DESCRIPTOR> &out) {
+    size_t attribute = record.find("id=\"0x0206\"");
+    if (attribute == std::string::npos) {
+        return 0;
+    }
+    size_t hex = record.find("encoding=\"hex\"", attribute);
+    size_t value = hex == std::string::npos ? hex : record.find("value=\"", hex);
+    size_t end_attribute = record.find("</attribute>", attribute);
+    if (value == std::string::npos || value > end_attribute) {
+        return 0;
+    }
+
+    size_t len = 0;
+    for (size_t pos = value + 7; pos < record.size() && record[pos] != '"'; pos += 2) {
+        int high = hex_digit(record[pos]);
+        int low = pos + 1 < record.size() ? hex_digit(record[pos + 1]) : -1;
+        if (high < 0 || low < 0 || len == out.size()) {
+            return 0;
+        }
+        out[len++] = static_cast<uint8_t>(high << 4 | low);
+    }
+    return len;
+}
+
+static const char *report_type_name(HidReportType type) {
+    switch (type) {
+    case HidReportType::Input: return "input";
+    case HidReportType::Output: return "output";
+    case HidReportType::Feature: return "feature";
+    }
+    return "?";
+}
+
+/* Print every report of a layout with the bit offset of its fields */
+void print_hid_layout(const HidDescriptorLayout &layout) {
+    for (size_t r = 0; r < layout.report_count; r++) {
+        const HidReportInfo &report = layout.reports[r];
+        std::cout << "  Report " << (int)report.id << " " << report_type_name(report.type)
+                  << ": " << (report.bits + 7) / 8 << " bytes after the report ID" << std::endl;
+
+        for (size_t f = 0; f < layout.field_count; f++) {
+            const HidField &field = layout.fields[f];
+            if (field.report_id != report.id || field.type != report.type) {
+                continue;
+            }
+            std::cout << "    bit " << field.bit_offset << ": " << field.count << " x " << (int)field.bit_size << " bits";
+            if (field.flags & HID_FIELD_CONSTANT) {
+                std::cout << ", padding" << std::endl;
+                continue;
+            }
+            std::cout << std::hex << ", page 0x" << field.usage_page << " usage 0x" << field.usage_min;
+            if (field.usage_max != field.usage_min) {
+                std::cout << "-0x" << field.usage_max;
+            }
+            std::cout << std::dec << ((field.flags & HID_FIELD_VARIABLE) ? "" : ", array")
+                      << ((field.flags & HID_FIELD_RELATIVE) ? ", relative" : "") << std::endl;
+        }
+    }
+}
+
+/*
+ * Check that a loaded descriptor declares every report the code sends
+ * (hid_layout) with the same size and field positions.
+ */
+bool validate_hid_layout(const HidDescriptorLayout &loaded) {
+    bool valid = true;
+
+    for (size_t r = 0; r < hid_layout.report_count; r++) {
+        const HidReportInfo &report = hid_layout.reports[r];
+        size_t expected = hid_layout.report_bytes(report.id, report.type);
+        size_t declared = loaded.report_bytes(report.id, report.type);
+        if (declared != expected) {
+            std::cerr << "Report " << (int)report.id << " " << report_type_name(report.type) << " is "
+                      << declared << " bytes in the SDP record, the code uses " << expected << std::endl;
+            valid = false;
+        }
+    }
+
+    for (size_t i = 0; i < hid_layout.field_count; i++) {
+        const HidField &field = hid_layout.fields[i];
+        bool found = false;
+        for (size_t j = 0; j < loaded.field_count && !found; j++) {
+            const HidField &other = loaded.fields[j];
+            found = other.report_id == field.report_id && other.type == field.type &&
+                    other.bit_offset == field.bit_offset && other.bit_size == field.bit_size &&
+                    other.count == field.count && other.flags == field.flags &&
+                    ((field.flags & HID_FIELD_CONSTANT) ||
+                     (other.usage_page == field.usage_page && other.usage_min == field.usage_min &&
+                      other.usage_max == field.usage_max));
+        }
+        if (!found) {
+            std::cerr << "Report " << (int)field.report_id << " " << report_type_name(field.type)
+                      << ": field at bit " << field.bit_offset << " (page 0x" << std::hex << field.usage_page
+                      << " usage 0x" << field.usage_min << std::dec << ") differs in the SDP record" << std::endl;
+            valid = false;
+        }
+    }
+    return valid;
+}
+
+/*
+ * Parse the report descriptor of an SDP record and check it against
+ * the reports the code sends. Once it passes, the compile-time
+ * hid_layout describes what is registered and the send paths use it.
+ */
+bool load_hid_descriptor(const std::string &record) {
+    std::array<uint8_t, HID_MAX_DESCRIPTOR> descriptor;
+    size_t len = extract_sdp_descriptor(record, descriptor);
+    if (len == 0) {
+        std::cerr << "No valid HID report descriptor (attribute 0x0206) in the SDP record!" << std::endl;
+        return false;
+    }
+
+    HidDescriptorLayout loaded = parse_hid_descriptor(descriptor.data(), len);
+    if (loaded.error) {
+        std::cerr << "HID report descriptor: " << loaded.error << " at byte " << loaded.error_offset << std::endl;
+        return false;
+    }
+
+    std::cout << "HID report descriptor: " << len << " bytes" << std::endl;
+    print_hid_layout(loaded);
+
+    return validate_hid_layout(loaded);
+}
+
 void init_bluez_profile(GDBusProxy *proxy){
     if (!proxy) {
         std::cerr << "Proxy is null! Cannot register profile." << std::endl;
@@ -842,6 +5623,12 @@ void init_bluez_profile(GDBusProxy *proxy){
         return;
     }
 
+    /* Hosts decode reports by this descriptor, don't register one the code doesn't follow */
+    if (!load_hid_descriptor(sdp_service_record)) {
+        std::cerr << "SDP record does not match the reports sent, not registering profile!" << std::endl;
+        return;
+    }
+
     /* Build options */
     GVariantBuilder options_builder;
     g_variant_builder_init(&options_builder, G_VARIANT_TYPE("a{sv}"));
@@ -963,11 +5750,276 @@ void init_server(){
 
 }
 
+void print_usage(const char *prog) {
+    std::cout << "Usage: " << prog << " [options]\n"
+              << "  --key-down-time <sec>   How long each key report is held (default 0.01), sets\n"
+              << "                          --fixed-rate\n"
+              << "  --key-delay <sec>       Delay before the next key report (default 0.05), sets\n"
+              << "                          --fixed-rate\n"
+              << "  --fixed-rate            Pace key reports with the delays above instead of adapting\n"
+              << "                          the rate to the link\n"
+              << "  --burst                 Type up to 6 characters per report (host must honour\n"
+              << "                          6KRO slot order)\n"
+              << "  --layout <name|path>    Host keyboard layout (default us, files in " LAYOUT_DIR ")\n"
+              << "  --host-layout <bdaddr>=<name|path>\n"
+              << "                          Keyboard layout for one host, may be repeated\n"
+              << "  --unicode <none|linux|windows|macos>\n"
+              << "                          Host input method for characters the layout can't type\n"
+              << "  --host-unicode <bdaddr>=<method>\n"
+              << "                          Unicode input method for one host, may be repeated\n"
+              << "  --keyboard-mode <6kro|nkro>\n"
+              << "                          Keyboard report: 6 key slots (ID 1) or a bit per key (ID 5)\n"
+              << "  --host-keyboard-mode <bdaddr>=<mode>\n"
+              << "                          Keyboard report for one host, may be repeated\n"
+              << "  --mouse-rate <hz>       Maximum mouse reports per second (default 125)\n"
+              << "  --host-mouse-rate <bdaddr>=<hz>\n"
+              << "                          Mouse report rate for one host, may be repeated\n"
+              << "  --mouse-mode <standard|hires>\n"
+              << "                          Mouse report for motion: 8-bit axes (ID 2) or 16-bit axes\n"
+              << "                          with a high resolution wheel (ID 4)\n"
+              << "  --log-mouse             Print every mouse report sent\n"
+              << "  --send-window <bytes>   Socket memory queued on the interrupt channel before\n"
+              << "                          reports are held back (default 4096)\n"
+              << "  --profile-db <path|none>\n"
+              << "                          Per-host settings and learned typing rates\n"
+              << "                          (default " PROFILE_DB_PATH ")\n"
+              << "  --rtt-interval <s>      Seconds between Scroll Lock latency probes while typing is\n"
+              << "                          idle, 0 = only on /probe (default 0). Probes are key\n"
+              << "                          presses and keep the host from idling or sleeping\n"
+              << "  --compile-text <src> <dst>\n"
+              << "                          Compile a text file into a report stream for /replay, using\n"
+              << "                          the other typing options, and exit\n"
+              << "  --compile-layout <src> <dst>\n"
+              << "                          Build a binary layout file from its text source and exit\n"
+              << "  -h, --help              Show this help" << std::endl;
+}
+
+/* A number of seconds from the command line: finite and not negative */
+bool parse_seconds(const char *arg, float &seconds) {
+    char *end = nullptr;
+    float value = strtof(arg, &end);
+    if (end == arg || *end != '\0' || !std::isfinite(value) || value < 0) {
+        std::cerr << "Expected a number of seconds, got " << arg << std::endl;
+        return false;
+    }
+    seconds = value;
+    return true;
+}
+
+/* A whole number from the command line within min..max, what names it in the error */
+bool parse_unsigned(const char *arg, const char *what, unsigned long min, unsigned long max, unsigned &value) {
+    char *end = nullptr;
+    errno = 0;
+    unsigned long parsed = isdigit(static_cast<unsigned char>(arg[0])) ? strtoul(arg, &end, 10) : 0;
+    if (!end || *end != '\0' || errno == ERANGE || parsed < min || parsed > max) {
+        std::cerr << what << " must be " << min << ".." << max << ", got " << arg << std::endl;
+        return false;
+    }
+    value = static_cast<unsigned>(parsed);
+    return true;
+}
+
+/* Returns false when the program should exit (bad option or --help) */
+bool parse_options(int argc, char *argv[]) {
+    enum { OPT_KEY_DOWN_TIME = 256, OPT_KEY_DELAY, OPT_BURST, OPT_LAYOUT, OPT_HOST_LAYOUT, OPT_UNICODE, OPT_HOST_UNICODE,
+           OPT_KEYBOARD_MODE, OPT_HOST_KEYBOARD_MODE,
+           OPT_COMPILE_LAYOUT, OPT_COMPILE_TEXT, OPT_MOUSE_RATE, OPT_MOUSE_MODE, OPT_LOG_MOUSE,
+           OPT_RTT_INTERVAL, OPT_SEND_WINDOW, OPT_FIXED_RATE, OPT_HOST_MOUSE_RATE, OPT_PROFILE_DB };
+
+    static const struct option long_options[] = {
+        { "key-down-time", required_argument, NULL, OPT_KEY_DOWN_TIME },
+        { "key-delay",     required_argument, NULL, OPT_KEY_DELAY },
+        { "fixed-rate",    no_argument,       NULL, OPT_FIXED_RATE },
+        { "burst",         no_argument,       NULL, OPT_BURST },
+        { "layout",        required_argument, NULL, OPT_LAYOUT },
+        { "host-layout",   required_argument, NULL, OPT_HOST_LAYOUT },
+        { "unicode",       required_argument, NULL, OPT_UNICODE },
+        { "host-unicode",  required_argument, NULL, OPT_HOST_UNICODE },
+        { "keyboard-mode", required_argument, NULL, OPT_KEYBOARD_MODE },
+        { "host-keyboard-mode", required_argument, NULL, OPT_HOST_KEYBOARD_MODE },
+        { "compile-layout", required_argument, NULL, OPT_COMPILE_LAYOUT },
+        { "compile-text",  required_argument, NULL, OPT_COMPILE_TEXT },
+        { "mouse-rate",    required_argument, NULL, OPT_MOUSE_RATE },
+        { "host-mouse-rate", required_argument, NULL, OPT_HOST_MOUSE_RATE },
+        { "profile-db",    required_argument, NULL, OPT_PROFILE_DB },
+        { "mouse-mode",    required_argument, NULL, OPT_MOUSE_MODE },
+        { "log-mouse",     no_argument,       NULL, OPT_LOG_MOUSE },
+        { "rtt-interval",  required_argument, NULL, OPT_RTT_INTERVAL },
+        { "send-window",   required_argument, NULL, OPT_SEND_WINDOW },
+        { "help",          no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int opt;
+    std::string layout_name;
+    const char *layout_source = NULL;
+    const char *text_source = NULL;
+
+    while ((opt = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+        switch (opt) {
+        case OPT_KEY_DOWN_TIME:
+            if (!parse_seconds(optarg, typing_options.key_down_time)) {
+                return false;
+            }
+            typing_options.adaptive_rate = false;
+            break;
+        case OPT_KEY_DELAY:
+            if (!parse_seconds(optarg, typing_options.key_delay)) {
+                return false;
+            }
+            typing_options.adaptive_rate = false;
+            break;
+        case OPT_FIXED_RATE:
+            typing_options.adaptive_rate = false;
+            break;
+        case OPT_BURST:
+            typing_options.burst = true;
+            break;
+        case OPT_LAYOUT:
+            layout_name = optarg;
+            command_line_fields |= PROFILE_LAYOUT;
+            break;
+        case OPT_HOST_LAYOUT:
+        case OPT_HOST_UNICODE:
+        case OPT_HOST_KEYBOARD_MODE:
+        case OPT_HOST_MOUSE_RATE: {
+            std::string arg = optarg;
+            size_t eq = arg.find('=');
+            bdaddr_t addr;
+            if (eq == std::string::npos || str2ba(arg.substr(0, eq).c_str(), &addr) < 0) {
+                std::cerr << "Expected <bdaddr>=<value>, got " << arg << std::endl;
+                return false;
+            }
+
+            char addr_str[18];
+            ba2str(&addr, addr_str);
+            std::string value = arg.substr(eq + 1);
+
+            if (opt == OPT_HOST_LAYOUT) {
+                host_layouts[addr_str] = value;
+            } else if (opt == OPT_HOST_MOUSE_RATE) {
+                unsigned rate;
+                if (!parse_unsigned(value.c_str(), "Mouse rate (Hz)", 1, 1000, rate)) {
+                    return false;
+                }
+                host_mouse_rates[addr_str] = rate;
+            } else if (opt == OPT_HOST_KEYBOARD_MODE) {
+                if (!parse_keyboard_mode(value, host_keyboard_modes[addr_str])) {
+                    std::cerr << "Unknown keyboard mode: " << value << std::endl;
+                    return false;
+                }
+            } else if (!parse_unicode_method(value, host_unicode_methods[addr_str])) {
+                std::cerr << "Unknown Unicode input method: " << value << std::endl;
+                return false;
+            }
+            break;
+        }
+        case OPT_UNICODE:
+            if (!parse_unicode_method(optarg, typing_options.unicode_method)) {
+                std::cerr << "Unknown Unicode input method: " << optarg << std::endl;
+                return false;
+            }
+            command_line_fields |= PROFILE_UNICODE_METHOD;
+            break;
+        case OPT_KEYBOARD_MODE:
+            if (!parse_keyboard_mode(optarg, typing_options.keyboard_mode)) {
+                std::cerr << "Unknown keyboard mode: " << optarg << std::endl;
+                return false;
+            }
+            command_line_fields |= PROFILE_KEYBOARD_MODE;
+            break;
+        case OPT_COMPILE_LAYOUT:
+            layout_source = optarg;
+            break;
+        case OPT_COMPILE_TEXT:
+            text_source = optarg;
+            break;
+        case OPT_MOUSE_RATE:
+            if (!parse_unsigned(optarg, "Mouse rate (Hz)", 1, 1000, mouse_report_rate)) {
+                return false;
+            }
+            command_line_fields |= PROFILE_MOUSE_RATE;
+            break;
+        case OPT_MOUSE_MODE:
+            if (strcmp(optarg, "standard") == 0) {
+                mouse_mode = MouseMode::Standard;
+            } else if (strcmp(optarg, "hires") == 0) {
+                mouse_mode = MouseMode::HighRes;
+            } else {
+                std::cerr << "Unknown mouse mode: " << optarg << std::endl;
+                return false;
+            }
+            break;
+        case OPT_LOG_MOUSE:
+            log_mouse_reports = true;
+            break;
+        case OPT_RTT_INTERVAL:
+            if (!parse_unsigned(optarg, "Probe interval (s)", 0, 86400, rtt_probe_interval)) {
+                return false;
+            }
+            break;
+        case OPT_PROFILE_DB:
+            host_profile_path = optarg;
+            break;
+        case OPT_SEND_WINDOW:
+            /* Compared with the int the socket reports */
+            if (!parse_unsigned(optarg, "Send window (bytes)", 1, INT_MAX, interrupt_send_window)) {
+                return false;
+            }
+            break;
+        case 'h':
+        default:
+            print_usage(argv[0]);
+            return false;
+        }
+    }
+
+    if (layout_source) {
+        if (optind >= argc) {
+            std::cerr << "--compile-layout needs a destination file" << std::endl;
+            return false;
+        }
+        exit(compile_layout(layout_source, argv[optind]) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    /* Load every layout up front so a bad file is reported at startup */
+    if (!layout_name.empty()) {
+        typing_options.layout = get_layout(layout_name);
+        if (!typing_options.layout && layout_name != "us") {
+            return false;
+        }
+    }
+    for (const auto &host : host_layouts) {
+        if (!get_layout(host.second) && host.second != "us") {
+            return false;
+        }
+    }
+
+    if (text_source) {
+        if (optind >= argc) {
+            std::cerr << "--compile-text needs a destination file" << std::endl;
+            return false;
+        }
+        TypingOptions options = typing_options;
+        options.unicode = unicode_input_for_host("", options.unicode_method, options.layout);
+        exit(compile_report_stream(text_source, argv[optind], options) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    return true;
+}
+
 int main(int argc, char *argv[]) {
+    if (!parse_options(argc, argv)) {
+        exit(EXIT_FAILURE);
+    }
+
     if (geteuid() != 0) {
         std::cerr << "Only root can run this script" << std::endl;
         exit(EXIT_FAILURE);
     }
+
+    if (host_profile_path != "none") {
+        host_profiles = HostProfileDb::open(host_profile_path);
+    }
     
     std::cout << "Restarting bluetooth service" << std::endl;
     system("service bluetooth stop");